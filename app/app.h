@@ -3,6 +3,8 @@
 #include <stdbool.h>
 #include <netinet/in.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <signal.h>
 #include <time.h>
 
 #ifndef APP_INCLUDES
@@ -10,12 +12,12 @@ enum Type {
   TString = 1,
   TInteger = 2,
   TList = 3,
-  TKeyVal = 4,
   TDict = 5
 };
 
 struct _LinkedList;
 struct _Value;
+struct Dict;
 
 typedef struct {
   int length;
@@ -25,13 +27,16 @@ typedef struct {
 typedef struct {
   String *key;
   struct _Value *val;
+  // Bytes val was decoded from. Only set when strings are borrowed from the
+  // source, str is NULL otherwise
+  String raw;
 } KeyVal;
 
 typedef union {
   int64_t integer;
   String *string;
   struct _LinkedList *list;
-  KeyVal * kv;
+  struct Dict *dict;
 } Thing;
 
 struct _Value {
@@ -48,21 +53,100 @@ struct _LinkedList {
 
 typedef struct _LinkedList LinkedList;
 
+typedef struct Dict {
+  int length;
+  // Keys are in increasing order, as bencode requires, and are looked up by
+  // binary search. A linear scan is used for dicts that weren't
+  bool sorted;
+  KeyVal entries[];
+} Dict;
+
+struct ArenaChunk;
+typedef struct Arena {
+  struct ArenaChunk *chunks;
+  size_t chunk_size;
+} Arena;
+
 typedef struct {
   char* str;
+  // Where decode_bencode allocates the Value tree
+  Arena *arena;
+  // Decoded strings point into the source instead of being copied. They
+  // aren't NUL terminated, and the source must outlive the tree
+  bool borrow_strings;
 } Cursor;
 
+// arena.c
+void arena_init(Arena *arena, size_t chunk_size);
+void *arena_alloc(Arena *arena, size_t size);
+void arena_free(Arena *arena);
+
 // decode_bencode.c
 Value *decode_bencode(Cursor *cur);
+int compare_key(String *s1, const char *s2, int s2_length);
+KeyVal *gethash_entry(Value *dict, char *key);
 Value *gethash(Value *dict, char *key);
 Value *gethash_safe(Value *dict, char *key, enum Type type);
 
+// stream_bencode.c
+#define BENCODE_MAX_DEPTH 64
+// Strings are allocated once their length is known, before any of their bytes
+// arrive. Nothing a tracker sends is near this
+#define BENCODE_MAX_STRING (4 * 1024 * 1024)
+
+typedef enum BencodeStatus {
+  BENCODE_NEED_MORE = 0,
+  BENCODE_DONE,
+  BENCODE_ERROR
+} BencodeStatus;
+
+enum BencodeToken {
+  BT_NONE = 0,
+  BT_INTEGER,
+  BT_LENGTH,
+  BT_STRING
+};
+
+// A list or dict that is still open
+typedef struct BencodeFrame {
+  Value *value;
+  // Lists
+  LinkedList *head;
+  LinkedList *tail;
+  // Dicts. Entries are malloc'd scratch until the dict is closed, key is
+  // waiting for its value
+  KeyVal *entries;
+  int length;
+  int capacity;
+  bool sorted;
+  String *key;
+} BencodeFrame;
+
+typedef struct BencodeParser {
+  Arena *arena;
+  BencodeFrame frames[BENCODE_MAX_DEPTH];
+  int depth;
+  // Token cut by the end of the last chunk
+  enum BencodeToken token;
+  int64_t integer;
+  int digits;
+  bool negative;
+  String *string;
+  int string_done;
+
+  Value *root;
+  const char *error;
+} BencodeParser;
+
+void bencode_parser_init(BencodeParser *p, Arena *arena);
+void bencode_parser_free(BencodeParser *p);
+BencodeStatus bencode_parser_feed(BencodeParser *p, const char *data, size_t len);
 
 // assert_type.c
 bool assert_type(Value *val, enum Type type, char *msg);
 // file.c
 String *read_file_to_string(const char *path);
-Value *read_torrent_file(const char* path);
+Value *read_torrent_file(const char* path, Arena *arena);
 
 
 // json.c
@@ -73,10 +157,11 @@ void pprint_hex(void *str, int len);
 
 
 // encode_bencode.c
+size_t encoded_size(Value *val);
 void encode_bencode(Value *val, Cursor *cur);
 
 // sha1.c
-void SHA1(char *hash_out, const char *str, uint32_t len);
+#include "sha1.h"
 
 // torrent.c
 enum PeerStage {
@@ -90,13 +175,28 @@ enum PeerStage {
   S_DONE = 7,
 };
 
+// Most pieces a single peer downloads at once
+#define MAX_PEER_PIECES 64
+// Most block requests from a peer waiting to be uploaded
+#define MAX_UPLOAD_REQUESTS 64
+
+typedef struct UploadRequest {
+  uint32_t index;
+  uint32_t begin;
+  uint32_t length;
+} UploadRequest;
+
 struct _Piece;
 typedef struct Peer {
   int peer_idx;
   int sock;
   enum PeerStage stage;
   uint8_t *bitmap;
-  uint8_t bitmap_size;
+  int bitmap_size;
+  // Pieces in bitmap, and how many of them are in PS_INIT. Updated as pieces
+  // are announced and change state, so they are never counted by a scan
+  int n_available;
+  int n_interesting;
 
   int priority;
   time_t last_msg_time;
@@ -104,12 +204,48 @@ typedef struct Peer {
   int buffer_size;
   int recv_bytes;
   int processed_bytes;
+  // Payload of a PIECE message being recieved straight into the piece buffer.
+  // block_dst is NULL while a payload is dropped, block_piece is set until the
+  // block is stored
+  struct _Piece *block_piece;
+  uint32_t block_idx;
+  uint8_t *block_dst;
+  uint32_t block_remaining;
   char peer_id[20];
 
   bool interested;
   bool unchoked;
-  // When stage = S_ACTIVE
-  struct _Piece *piece;
+  // When stage = S_ACTIVE. Pieces being downloaded from this peer, oldest first
+  struct _Piece *pieces[MAX_PEER_PIECES];
+  int n_pieces;
+
+  // Request pipeline. max_requests is sized from speed and rtt
+  int outstanding_requests;
+  int max_requests;
+  float rtt_ms;
+  uint32_t speed_bytes_recieved;
+  float speed_timestamp_ms;
+  float speed_ma;
+
+  // Messages the socket didn't take yet. Sent before anything else
+  uint8_t *sendbuffer;
+  int sendbuffer_size;
+  int send_bytes;
+  // Set when the socket refused data. Output is flushed once it is writable
+  bool write_blocked;
+  // io_uring only. A POLLOUT for the socket is in flight
+  bool send_poll_pending;
+  // Watched by the event loop. Cleared when the peer is released after it
+  // failed or was closed
+  bool registered;
+
+  // Requests from the peer, served in order from the output file. upload_sent
+  // bytes of the first one, header included, are already sent
+  UploadRequest uploads[MAX_UPLOAD_REQUESTS];
+  int upload_head;
+  int n_uploads;
+  uint32_t upload_sent;
+  uint64_t uploaded_bytes;
 } Peer;
 
 enum MSG_TYPE {
@@ -137,15 +273,26 @@ typedef struct Message {
 enum PIECE_STATE {
   PS_INIT = 0,
   PS_DOWNLOADING,
+  PS_VERIFYING,
   PS_DOWNLOADED,
   PS_FLUSHED
 };
 
+// Most peers downloading a single piece at once, in endgame mode
+#define MAX_PIECE_PEERS 8
+// Size of the blocks a piece is requested in
+#define PIECE_BLOCK_SIZE (16 * 1024)
+
 typedef struct _Piece {
   uint32_t piece_idx;
   enum PIECE_STATE state;
-  Peer *current_peer;
+  // Peers downloading this piece. More than one only in endgame mode. Free
+  // slots are NULL
+  Peer *peers[MAX_PIECE_PEERS];
+  int n_peers;
   String hash;
+  // Index in Torrent.downloading while in PS_DOWNLOADING
+  int downloading_pos;
 
   // After a piece is activated
   uint64_t piece_length;
@@ -155,23 +302,130 @@ typedef struct _Piece {
 
   // After a piece is activate and while is downloading or downloaded
   uint8_t* buffer;
+  // buffer points into the mapped output file, see storage_map
+  bool mapped;
+  // Pool slot holding buffer, unless mapped, and the block maps
+  uint8_t *slot;
+  // Per block, bitmask of the slots in peers that were asked for it
   uint8_t* asked_blocks;
-  uint8_t* recieved_blocks;
+  // Bitsets over the blocks: recieved, and asked from at least one peer
+  uint64_t *recieved_blocks;
+  uint64_t *requested_blocks;
+  uint32_t block_words;
   uint32_t recieved_count;
   uint32_t outstanding_requests_count;
 
-  uint32_t speed_bytes_recieved;
-  float speed_timestamp_ms;
-  float speed_ma;
+  // Running hash over blocks [0, hashed_blocks)
+  SHA1_CTX sha_ctx;
+  uint32_t hashed_blocks;
+
+  // While being written by io_uring
+  uint64_t flushed_bytes;
+
+  // Block bitmap saved by an earlier run, until the piece is activated
+  uint8_t *resume_blocks;
 } Piece;
 
+typedef struct Uring Uring;
+typedef struct DiskQueue DiskQueue;
+typedef struct DiskResult DiskResult;
+
+typedef struct PiecePool {
+  size_t slot_size;
+  int max_slots;
+  int n_slots;
+  uint8_t **slots;
+  int n_free;
+  uint8_t **free_slots;
+  // A piece couldn't be activated for want of a slot
+  bool starved;
+} PiecePool;
+
+#define MAX_WRITE_FAILURES 3
+
+// Memory pieces being downloaded may take, unless TORRENT_PIECE_MEMORY sets it
+#define DEFAULT_PIECE_MEMORY (256ULL * 1024 * 1024)
+
+typedef struct PiecePicker {
+  int n_pieces;
+  uint32_t *availability;
+  uint32_t *order;
+  uint32_t *pos;
+  uint32_t *bucket_start;
+  uint32_t n_buckets;
+} PiecePicker;
+
+// A file of the torrent, and where it starts in the torrent's byte range
+typedef struct StorageFile {
+  char *path;
+  uint64_t offset;
+  uint64_t length;
+  // -1 while closed
+  int fd;
+  // I/Os using fd. Not closed until they are done
+  int pins;
+  // Open files, most recently used first
+  int lru_prev;
+  int lru_next;
+} StorageFile;
+
+typedef struct Storage {
+  StorageFile *files;
+  int n_files;
+  uint64_t length;
+  bool read_only;
+  int max_open;
+  int n_open;
+  int lru_head;
+  int lru_tail;
+  pthread_mutex_t lock;
+  // Whole single file, when mapped by storage_map
+  uint8_t *map;
+} Storage;
+
+// Part of a range that lies in a single file
+typedef struct StorageSpan {
+  int file_idx;
+  int fd;
+  uint64_t file_offset;
+  uint64_t length;
+} StorageSpan;
+
 typedef struct Torrent {
   Piece *pieces;
   int n_pieces;
   int active_pieces;
   int downloaded_pieces;
-  FILE *output_file;
+  Storage *storage;
   FILE *summary_file;
+  // Fast-resume sidecar. NULL to disable
+  char *resume_path;
+  time_t resume_saved_at;
+  // The periodic save is waiting on its stat from the disk thread
+  bool resume_stat_pending;
+  bool use_io_uring;
+  Uring *ring;
+  DiskQueue *disk;
+  PiecePicker picker;
+  PiecePool pool;
+  uint64_t piece_memory;
+  // Pieces in PS_INIT, in BITFIELD order, while the communication loop runs
+  uint8_t *wanted;
+  // Pieces in each state, and the blocks recieved of those in PS_DOWNLOADING.
+  // Kept by set_piece_state while the communication loop runs
+  int piece_states[PS_FLUSHED + 1];
+  uint64_t downloading_blocks;
+  // Piece writes that failed in a row. The download stops at
+  // MAX_WRITE_FAILURES, as the disk won't take the data
+  int write_failures;
+  bool disk_failed;
+  // Pieces in PS_DOWNLOADING, in no particular order. Each holds a pool
+  // slot, so there are at most pool.max_slots
+  Piece **downloading;
+  int n_downloading;
+  // While the communication loop runs
+  Peer *peers;
+  int n_peers;
 
   // Init
   String infohash;
@@ -184,6 +438,8 @@ typedef struct Torrent {
 
 extern time_t NOW;
 extern float NOW_MS;
+// Set by SIGINT/SIGTERM. The download stops as if it were complete
+extern volatile sig_atomic_t STOP_REQUESTED;
 
 uint64_t torrent_total_length(Value *info);
 String info_hash(Value* torrent);
@@ -193,6 +449,104 @@ Torrent create_torrent(Value *torrent);
 void free_torrent(Torrent *o);
 Peer create_peer(int peer_idx, int n_pieces, size_t buffer_size);
 void free_peer(Peer *p);
+void process_peer_messages(Peer *peer, Torrent *t);
+void process_peer_bytes(Peer *peer, Torrent *t, uint8_t *data, int len);
+void process_peer_writable(Peer *p, Torrent *t);
+void deactivate_peer_and_pieces(Torrent *t, Peer *peer);
+void update_peer_pipeline(Peer *p);
+bool verify_piece(Piece *piece);
+void piece_flushed(Torrent *t, Piece *piece);
+void piece_write_failed(Torrent *t, Piece *piece);
+uint64_t piece_size(Torrent *t, uint32_t piece_idx);
+void process_disk_completions(Torrent *t);
+void update_clock(time_t baseline_secs);
+bool finish_loop_iteration(Peer *peers, int n_peers, Torrent *t);
+void forget_peer_pieces(Torrent *t, Peer *peer);
+void peer_failed(Torrent *t, Peer *peer);
+
+// uring.c
+Uring *uring_create(unsigned entries);
+void uring_free(Uring *ring);
+int start_uring_loop(Peer *peers, int n_peers, Torrent *t);
+void uring_write_piece(Uring *ring, Torrent *t, Piece *piece);
+
+// picker.c
+void picker_init(PiecePicker *picker, int n_pieces);
+void picker_free(PiecePicker *picker);
+void picker_inc(PiecePicker *picker, uint32_t piece_idx);
+void picker_dec(PiecePicker *picker, uint32_t piece_idx);
+void picker_remove(PiecePicker *picker, uint32_t piece_idx);
+void picker_add(PiecePicker *picker, uint32_t piece_idx);
+Piece *picker_select(PiecePicker *picker, Piece *pieces, Peer *peer);
+
+// bitfield.c
+void bitfield_or(uint8_t *dst, const uint8_t *src, uint8_t *added, int n_bytes);
+int bitfield_and_count(const uint8_t *a, const uint8_t *b, int n_bytes);
+int bitfield_count(const uint8_t *bits, int n_bytes);
+int bitfield_next_set(const uint8_t *bits, int n_bytes, int from);
+
+// pool.c
+void pool_init(PiecePool *pool, size_t slot_size, int max_slots);
+void pool_free(PiecePool *pool);
+bool pool_exhausted(PiecePool *pool);
+uint8_t *pool_acquire(PiecePool *pool);
+void pool_release(PiecePool *pool, uint8_t *slot);
+
+// resume.c
+void save_resume(Torrent *t, bool with_partial);
+bool request_resume_save(Torrent *t);
+void resume_stat_done(Torrent *t, DiskResult *result);
+int load_resume(Torrent *t);
+void restore_resume_blocks(Torrent *t, Piece *piece);
+
+// recheck.c
+uint8_t *recheck_pieces(Torrent *t, uint8_t *only, int n_threads);
+int apply_recheck(Torrent *t, uint8_t *bitmap);
+
+// storage.c
+bool pread_all(int fd, uint8_t *buffer, uint64_t length, uint64_t offset);
+bool pwrite_all(int fd, uint8_t *buffer, uint64_t length, uint64_t offset);
+Storage *storage_create(Value *info, const char *path, bool read_only);
+void storage_free(Storage *s);
+bool storage_map(Storage *s);
+int storage_locate(Storage *s, uint64_t offset);
+int storage_acquire(Storage *s, int file_idx);
+void storage_release(Storage *s, int file_idx);
+bool storage_acquire_span(Storage *s, uint64_t offset, uint64_t length, StorageSpan *span);
+bool storage_read(Storage *s, uint8_t *buffer, uint64_t length, uint64_t offset);
+bool storage_write(Storage *s, uint8_t *buffer, uint64_t length, uint64_t offset);
+void storage_stat(Storage *s, uint64_t *size, struct timespec *mtime);
+void storage_truncate(Storage *s);
+
+// disk.c
+typedef struct DiskJob {
+  Piece *piece;
+  // Stat the files of storage instead of handling a piece
+  bool stat;
+  Storage *storage; // write there after verifying, if set
+  uint64_t offset;
+} DiskJob;
+
+struct DiskResult {
+  Piece *piece;
+  bool verified;
+  bool flushed;
+  // The job had storage and the write failed
+  bool write_failed;
+  // Result of a stat job, piece is NULL
+  bool stat;
+  uint64_t file_size;
+  struct timespec mtime;
+};
+
+DiskQueue *disk_start();
+void disk_stop(DiskQueue *d);
+int disk_event_fd(DiskQueue *d);
+int disk_in_flight(DiskQueue *d);
+bool disk_full(DiskQueue *d);
+void disk_submit(DiskQueue *d, DiskJob job);
+void disk_wait_completion(DiskQueue *d);
+bool disk_pop_completion(DiskQueue *d, DiskResult *result);
 
 // tracker.c
 int fetch_peers(Value *torrent, struct sockaddr_in **peers);
@@ -200,8 +554,6 @@ int fetch_peers(Value *torrent, struct sockaddr_in **peers);
 // torrent_utils.c
 uint64_t torrent_total_length(Value *info);
 String info_hash(Value *torrent);
-int count_interesting_pieces(Torrent *t, Peer *p);
-int count_available_pieces(Peer *p, int n_pieces);
 
 // print_summary.c
 void print_summary(Peer *peers, uint16_t n_peers, Torrent *t);
@@ -217,6 +569,9 @@ int ceil_division(int divident, int divisor);
 void pprint_sockaddr(struct sockaddr_in addr);
 bool aref_bit(uint8_t *bitmap, int n_bytes, int index);
 void setf_bit(uint8_t *bitmap, int n_bytes, int index, bool value);
+bool bitset_get(uint64_t *bits, uint32_t index);
+void bitset_set(uint64_t *bits, uint32_t index);
+void bitset_clear(uint64_t *bits, uint32_t index);
 
 
 #ifndef htonll
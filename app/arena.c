@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "app.h"
+
+// Bump allocator. Memory is handed out from chunks that double in size, and
+// is only released all at once by arena_free. An allocation bigger than the
+// next chunk gets a chunk of its own, kept behind the current one so the space
+// left there is still used.
+
+#define ARENA_ALIGN 8
+#define ARENA_MAX_CHUNK (16 * 1024 * 1024)
+
+struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t size;
+  size_t used;
+  uint8_t data[];
+};
+
+void arena_init(Arena *arena, size_t chunk_size) {
+  arena->chunks = NULL;
+  arena->chunk_size = chunk_size < 1024 ? 1024 : chunk_size;
+}
+
+struct ArenaChunk *arena_new_chunk(size_t size) {
+  struct ArenaChunk *chunk = malloc(sizeof(struct ArenaChunk) + size);
+  if (chunk == NULL) {
+    fprintf(stderr, "Out of memory. Couldn't allocate arena chunk of %zu bytes\n", size);
+    exit(1);
+  }
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+  struct ArenaChunk *head = arena->chunks;
+  if (head != NULL && head->size - head->used >= size) {
+    void *ptr = head->data + head->used;
+    head->used += size;
+    return ptr;
+  }
+
+  if (head != NULL && size > arena->chunk_size) {
+    struct ArenaChunk *chunk = arena_new_chunk(size);
+    chunk->used = size;
+    chunk->next = head->next;
+    head->next = chunk;
+    return chunk->data;
+  }
+
+  size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+  struct ArenaChunk *chunk = arena_new_chunk(chunk_size);
+  chunk->used = size;
+  chunk->next = head;
+  arena->chunks = chunk;
+  if (arena->chunk_size < ARENA_MAX_CHUNK) arena->chunk_size *= 2;
+  return chunk->data;
+}
+
+void arena_free(Arena *arena) {
+  struct ArenaChunk *chunk = arena->chunks;
+  while (chunk != NULL) {
+    struct ArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  arena->chunks = NULL;
+}
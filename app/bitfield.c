@@ -0,0 +1,137 @@
+#include <stdint.h>
+#include <string.h>
+#include "app.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Word-wide operations on bitmaps in BITFIELD order, where piece i is bit
+// 7 - i % 8 of byte i / 8. OR, AND and popcount don't depend on the order of
+// the bits, so they run over whole words, or 32 bytes at a time with AVX2 when
+// the CPU has it. AVX2 is detected with sha1.c's CPUID check. Set bits are
+// found with a count of leading zeros on words loaded big-endian, which keeps
+// the BITFIELD order.
+
+typedef void (*BitfieldOrFn)(uint8_t *dst, const uint8_t *src, uint8_t *added, int n_bytes);
+typedef int (*BitfieldAndCountFn)(const uint8_t *a, const uint8_t *b, int n_bytes);
+
+uint64_t bitfield_load_word(const uint8_t *p) {
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+// The word holding bits [8 * i, 8 * i + 64), first bit in the top position
+uint64_t bitfield_load_ordered(const uint8_t *p) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return __builtin_bswap64(bitfield_load_word(p));
+#else
+  return bitfield_load_word(p);
+#endif
+}
+
+void bitfield_or_portable(uint8_t *dst, const uint8_t *src, uint8_t *added, int n_bytes) {
+  int i = 0;
+  for (; i + 8 <= n_bytes; i += 8) {
+    uint64_t d = bitfield_load_word(dst + i);
+    uint64_t s = bitfield_load_word(src + i);
+    uint64_t a = s & ~d;
+    d |= s;
+    memcpy(dst + i, &d, sizeof(d));
+    memcpy(added + i, &a, sizeof(a));
+  }
+  for (; i < n_bytes; i++) {
+    added[i] = src[i] & ~dst[i];
+    dst[i] |= src[i];
+  }
+}
+
+int bitfield_and_count_portable(const uint8_t *a, const uint8_t *b, int n_bytes) {
+  int count = 0;
+  int i = 0;
+  for (; i + 8 <= n_bytes; i += 8) {
+    count += __builtin_popcountll(bitfield_load_word(a + i) & bitfield_load_word(b + i));
+  }
+  for (; i < n_bytes; i++) {
+    count += __builtin_popcount(a[i] & b[i]);
+  }
+  return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void bitfield_or_avx2(uint8_t *dst, const uint8_t *src, uint8_t *added, int n_bytes) {
+  int i = 0;
+  for (; i + 32 <= n_bytes; i += 32) {
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(added + i), _mm256_andnot_si256(d, s));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(d, s));
+  }
+  bitfield_or_portable(dst + i, src + i, added + i, n_bytes - i);
+}
+
+// Popcount of each byte from two nibble lookups, summed into 64-bit lanes
+__attribute__((target("avx2")))
+int bitfield_and_count_avx2(const uint8_t *a, const uint8_t *b, int n_bytes) {
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                          0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i total = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 32 <= n_bytes; i += 32) {
+    __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+    __m256i low = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, nibble));
+    __m256i high = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(low, high), _mm256_setzero_si256()));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, total);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + bitfield_and_count_portable(a + i, b + i, n_bytes - i);
+}
+#endif
+
+BitfieldOrFn bitfield_or_impl = bitfield_or_portable;
+BitfieldAndCountFn bitfield_and_count_impl = bitfield_and_count_portable;
+
+__attribute__((constructor))
+void bitfield_select_kernels() {
+#if defined(__x86_64__) || defined(__i386__)
+  if (cpu_has_avx2()) {
+    bitfield_or_impl = bitfield_or_avx2;
+    bitfield_and_count_impl = bitfield_and_count_avx2;
+  }
+#endif
+}
+
+// dst |= src. The bits that were new to dst are written to added
+void bitfield_or(uint8_t *dst, const uint8_t *src, uint8_t *added, int n_bytes) {
+  bitfield_or_impl(dst, src, added, n_bytes);
+}
+
+// Number of bits set in both a and b
+int bitfield_and_count(const uint8_t *a, const uint8_t *b, int n_bytes) {
+  return bitfield_and_count_impl(a, b, n_bytes);
+}
+
+int bitfield_count(const uint8_t *bits, int n_bytes) {
+  return bitfield_and_count_impl(bits, bits, n_bytes);
+}
+
+// Index of the first set bit at or after from, -1 when there is none
+int bitfield_next_set(const uint8_t *bits, int n_bytes, int from) {
+  int i = from / 8;
+  if (i >= n_bytes) return -1;
+  uint8_t first = bits[i] & (0xff >> (from % 8));
+  if (first != 0) return i * 8 + __builtin_clz(first) - 24;
+
+  for (i++; i + 8 <= n_bytes; i += 8) {
+    uint64_t word = bitfield_load_ordered(bits + i);
+    if (word != 0) return i * 8 + __builtin_clzll(word);
+  }
+  for (; i < n_bytes; i++) {
+    if (bits[i] != 0) return i * 8 + __builtin_clz(bits[i]) - 24;
+  }
+  return -1;
+}
@@ -15,15 +15,18 @@ String *decode_string(Cursor *cur) {
   const char* colon_index = strchr(cur->str, ':');
   if (colon_index != NULL) {
     const char* start = colon_index + 1;
-    char* decoded_str = (char*)malloc(length + 1);
-    for (int i = 0; i < length; i++) {
-      *(decoded_str+i) = *(start+i);
+    char* decoded_str;
+    if (cur->borrow_strings) {
+      decoded_str = (char *)start;
+    } else {
+      decoded_str = arena_alloc(cur->arena, length + 1);
+      memcpy(decoded_str, start, length);
+      decoded_str[length] = '\0';
     }
-    decoded_str[length] = '\0';
     int read = (start - cur->str + length) - 1;
     cur->str += read;
 
-    String *string = malloc(sizeof(String));
+    String *string = arena_alloc(cur->arena, sizeof(String));
     string->length = length;
     string->str = decoded_str;
     return string;
@@ -35,19 +38,29 @@ String *decode_string(Cursor *cur) {
 
 int64_t decode_integer(Cursor *cur) {
   int64_t res = 0;
+  int digits = 0;
   bool negative = false;
   while (*(++cur->str) != 'e') {
     if (*cur->str == '-') {
       negative = true;
     } else {
+      if (digits > 0 && res == 0) {
+        fprintf(stderr, "Couldn't decode integer. Leading zeros are invalid\n");
+        exit(1);
+      }
       res = res * 10 + (*cur->str - '0');
+      digits++;
     }
   }
+  if (negative && res == 0) {
+    fprintf(stderr, "Couldn't decode integer. Negative zero is invalid\n");
+    exit(1);
+  }
   return res * (negative ? -1 : 1);
 }
 
-LinkedList* cons(Value *val, LinkedList* list) {
-  LinkedList *cell = malloc(sizeof(LinkedList));
+LinkedList* cons(Arena *arena, Value *val, LinkedList* list) {
+  LinkedList *cell = arena_alloc(arena, sizeof(LinkedList));
   cell->val = val;
   cell->next = list;
   return cell;
@@ -60,10 +73,10 @@ LinkedList *decode_list(Cursor *cur) {
   while (*(++cur->str) != 'e') {
     Value *val = decode_bencode(cur);
     if (tail == NULL) { // first item of list
-      head = cons(val, NULL);
+      head = cons(cur->arena, val, NULL);
       tail = head;
     } else {
-      LinkedList *new_cell = cons(val, NULL);
+      LinkedList *new_cell = cons(cur->arena, val, NULL);
       tail->next = new_cell;
       tail = new_cell;
     }
@@ -72,76 +85,97 @@ LinkedList *decode_list(Cursor *cur) {
   return head;
 }
 
-Value *read_keyval(Cursor *cur) {
+void read_keyval(Cursor *cur, KeyVal *kv) {
   String *key = decode_string(cur);
   cur->str++;
+  char *start = cur->str;
   Value *val = decode_bencode(cur);
-  KeyVal *kv = malloc(sizeof(KeyVal));
   kv->key = key;
   kv->val = val;
-  Value *ret = malloc(sizeof(Value));
-  ret->type = TKeyVal;
-  ret->val.kv = kv;
-  return ret;
+  // cur is left on the last byte of val
+  kv->raw.str = cur->borrow_strings ? start : NULL;
+  kv->raw.length = cur->borrow_strings ? cur->str - start + 1 : 0;
 }
 
-LinkedList *decode_dict(Cursor *cur) {
-  LinkedList *head = NULL;
-  LinkedList *tail = NULL;
-
-  while (*(++cur->str) != 'e') {
-    Value *kv = read_keyval(cur);
-    if (tail == NULL) { // first item of list
-      head = cons(kv, NULL);
-      tail = head;
-    } else {
-      LinkedList *new_cell = cons(kv, NULL);
-      tail->next = new_cell;
-      tail = new_cell;
-    }
-  }
-  return head;
+// Byte order, shorter first on a common prefix. Same as bencode key order
+int compare_key(String *s1, const char *s2, int s2_length) {
+  int length = s1->length < s2_length ? s1->length : s2_length;
+  int cmp = memcmp(s1->str, s2, length);
+  if (cmp != 0) return cmp;
+  return s1->length - s2_length;
 }
 
-bool string_equal(String* s1, char* s2) {
-  char *ss1 = s1->str;
-  int count = 0;
-  while (*s2 != '\0') {
-    if (count == s1->length)
-      return false;
+#define DICT_STACK_ENTRIES 16
 
-    if (*ss1 != *s2)
-      return false;
+// Entries are collected in a scratch array first, then copied to the arena
+// once their number is known
+Dict *decode_dict(Cursor *cur) {
+  KeyVal stack_entries[DICT_STACK_ENTRIES];
+  KeyVal *entries = stack_entries;
+  int capacity = DICT_STACK_ENTRIES;
+  int length = 0;
+  bool sorted = true;
 
-    ss1++;
-    s2++;
-    count++;
+  while (*(++cur->str) != 'e') {
+    if (length == capacity) {
+      capacity *= 2;
+      if (entries == stack_entries) {
+        entries = malloc(sizeof(KeyVal) * capacity);
+        memcpy(entries, stack_entries, sizeof(stack_entries));
+      } else {
+        entries = realloc(entries, sizeof(KeyVal) * capacity);
+      }
+    }
+    read_keyval(cur, entries + length);
+    if (length > 0) {
+      String *prev = entries[length - 1].key;
+      if (compare_key(prev, entries[length].key->str, entries[length].key->length) >= 0) sorted = false;
+    }
+    length++;
   }
-  return true;
+
+  Dict *dict = arena_alloc(cur->arena, sizeof(Dict) + sizeof(KeyVal) * length);
+  dict->length = length;
+  dict->sorted = sorted;
+  memcpy(dict->entries, entries, sizeof(KeyVal) * length);
+  if (entries != stack_entries) free(entries);
+  return dict;
 }
 
-Value *gethash(Value *dict, char *key) {
+KeyVal *gethash_entry(Value *dict, char *key) {
   if (!assert_type(dict, TDict, "[gethash] Expected dict. Got %d\n")) {
     exit(1);
   }
 
-  LinkedList *_entry = dict->val.list;
-  while (_entry != NULL) {
-    Value *entry = _entry->val;
-    if (entry->type != TKeyVal) {
-      fprintf(stderr, "[BUG] dictionary entry is not a Keyval. Got %d\n", entry->type);
-      exit(1);
-    }
-    KeyVal *kv = entry->val.kv;
-    if (string_equal(kv->key, key)) {
-      return kv->val;
+  Dict *d = dict->val.dict;
+  int key_length = strlen(key);
+  if (!d->sorted) {
+    for (int i = 0; i < d->length; i++) {
+      if (compare_key(d->entries[i].key, key, key_length) == 0) return d->entries + i;
     }
+    return NULL;
+  }
 
-    _entry = _entry->next;
+  int low = 0;
+  int high = d->length;
+  while (low < high) {
+    int mid = (low + high) / 2;
+    int cmp = compare_key(d->entries[mid].key, key, key_length);
+    if (cmp == 0) return d->entries + mid;
+    if (cmp < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
   }
   return NULL;
 }
 
+Value *gethash(Value *dict, char *key) {
+  KeyVal *kv = gethash_entry(dict, key);
+  return kv == NULL ? NULL : kv->val;
+}
+
 Value *gethash_safe(Value *dict, char *key, enum Type type) {
   Value *val = gethash(dict, key);
   if (val == NULL) {
@@ -157,8 +191,10 @@ Value *gethash_safe(Value *dict, char *key, enum Type type) {
   return val;
 }
 
+// Every node of the tree is allocated from cur->arena, and lives until it is
+// freed
 Value *decode_bencode(Cursor *cur) {
-  Value* ret = malloc(sizeof(Value));
+  Value* ret = arena_alloc(cur->arena, sizeof(Value));
   if (is_digit(cur->str[0])) {
     ret->type = TString;
     ret->val.string = decode_string(cur);
@@ -173,7 +209,7 @@ Value *decode_bencode(Cursor *cur) {
 
   } else if (cur->str[0] == 'd') {
     ret->type = TDict;
-    ret->val.list = decode_dict(cur);
+    ret->val.dict = decode_dict(cur);
 
   } else {
     fprintf(stderr, "Only strings are supported at the moment\n");
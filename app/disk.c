@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "app.h"
+
+#define DEBUG false
+
+// Disk stage. A worker thread hashes finished pieces and writes the good ones
+// to disk, so that the network loop never stalls on SHA1 or write(). Results
+// are handed back through a completion queue, and event_fd is signalled so the
+// loop wakes up to collect them.
+//
+// At most DISK_QUEUE_SIZE pieces are in flight (queued, being worked on, or
+// waiting to be collected), so the completion queue can never overflow.
+
+#define DISK_QUEUE_SIZE 32
+
+struct DiskQueue {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t job_ready;
+  pthread_cond_t job_done;
+  bool stop;
+  int event_fd;
+
+  DiskJob jobs[DISK_QUEUE_SIZE];
+  int job_head;
+  int job_count;
+
+  DiskResult results[DISK_QUEUE_SIZE];
+  int result_head;
+  int result_count;
+
+  int in_flight;
+};
+
+bool write_piece_to_storage(DiskJob *job) {
+  Piece *piece = job->piece;
+  if (!storage_write(job->storage, piece->buffer, piece->piece_length, job->offset)) {
+    fprintf(stderr, "Couldn't write piece %d to disk: %d %s\n", piece->piece_idx, errno, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void *disk_worker(void *arg) {
+  DiskQueue *d = arg;
+
+  pthread_mutex_lock(&d->lock);
+  while (true) {
+    while (d->job_count == 0 && !d->stop) {
+      pthread_cond_wait(&d->job_ready, &d->lock);
+    }
+    if (d->job_count == 0 && d->stop) break;
+
+    DiskJob job = d->jobs[d->job_head];
+    d->job_head = (d->job_head + 1) % DISK_QUEUE_SIZE;
+    d->job_count--;
+    pthread_mutex_unlock(&d->lock);
+
+    DiskResult result = {.piece = job.piece, .stat = job.stat};
+    if (job.stat) {
+      storage_stat(job.storage, &result.file_size, &result.mtime);
+    } else if ((result.verified = verify_piece(job.piece)) && job.storage != NULL) {
+      result.flushed = write_piece_to_storage(&job);
+      result.write_failed = !result.flushed;
+    }
+
+    pthread_mutex_lock(&d->lock);
+    int tail = (d->result_head + d->result_count) % DISK_QUEUE_SIZE;
+    d->results[tail] = result;
+    d->result_count++;
+    pthread_cond_signal(&d->job_done);
+
+    uint64_t one = 1;
+    write(d->event_fd, &one, sizeof(one));
+  }
+  pthread_mutex_unlock(&d->lock);
+  return NULL;
+}
+
+DiskQueue *disk_start() {
+  DiskQueue *d = malloc(sizeof(DiskQueue));
+  memset(d, 0, sizeof(DiskQueue));
+  d->event_fd = eventfd(0, EFD_NONBLOCK);
+  if (d->event_fd == -1) {
+    fprintf(stderr, "Couldn't create eventfd for disk queue: %d %s\n", errno, strerror(errno));
+    exit(1);
+  }
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_cond_init(&d->job_ready, NULL);
+  pthread_cond_init(&d->job_done, NULL);
+  if (pthread_create(&d->thread, NULL, disk_worker, d) != 0) {
+    fprintf(stderr, "Couldn't start disk thread\n");
+    exit(1);
+  }
+  return d;
+}
+
+void disk_stop(DiskQueue *d) {
+  pthread_mutex_lock(&d->lock);
+  d->stop = true;
+  pthread_cond_signal(&d->job_ready);
+  pthread_mutex_unlock(&d->lock);
+  pthread_join(d->thread, NULL);
+
+  close(d->event_fd);
+  pthread_mutex_destroy(&d->lock);
+  pthread_cond_destroy(&d->job_ready);
+  pthread_cond_destroy(&d->job_done);
+  free(d);
+}
+
+int disk_event_fd(DiskQueue *d) {
+  return d->event_fd;
+}
+
+int disk_in_flight(DiskQueue *d) {
+  pthread_mutex_lock(&d->lock);
+  int in_flight = d->in_flight;
+  pthread_mutex_unlock(&d->lock);
+  return in_flight;
+}
+
+bool disk_full(DiskQueue *d) {
+  return disk_in_flight(d) >= DISK_QUEUE_SIZE;
+}
+
+void disk_submit(DiskQueue *d, DiskJob job) {
+  pthread_mutex_lock(&d->lock);
+  if (d->in_flight >= DISK_QUEUE_SIZE) {
+    fprintf(stderr, "[BUG] disk_submit called on a full queue\n");
+    exit(1);
+  }
+  int tail = (d->job_head + d->job_count) % DISK_QUEUE_SIZE;
+  d->jobs[tail] = job;
+  d->job_count++;
+  d->in_flight++;
+  pthread_cond_signal(&d->job_ready);
+  pthread_mutex_unlock(&d->lock);
+  if (DEBUG && !job.stat) printf("Queued piece %d for hashing\n", job.piece->piece_idx);
+}
+
+// Block until at least one result is waiting to be popped
+void disk_wait_completion(DiskQueue *d) {
+  pthread_mutex_lock(&d->lock);
+  while (d->result_count == 0) {
+    pthread_cond_wait(&d->job_done, &d->lock);
+  }
+  pthread_mutex_unlock(&d->lock);
+}
+
+bool disk_pop_completion(DiskQueue *d, DiskResult *result) {
+  pthread_mutex_lock(&d->lock);
+  if (d->result_count == 0) {
+    // Nothing left. Reset the eventfd counter
+    uint64_t count;
+    read(d->event_fd, &count, sizeof(count));
+    pthread_mutex_unlock(&d->lock);
+    return false;
+  }
+  *result = d->results[d->result_head];
+  d->result_head = (d->result_head + 1) % DISK_QUEUE_SIZE;
+  d->result_count--;
+  d->in_flight--;
+  pthread_mutex_unlock(&d->lock);
+  return true;
+}
@@ -3,20 +3,67 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-void encode_str(String* string, Cursor *cur) {
-  int length = string->length;
-  int written_chars = sprintf(cur->str, "%d:", length);
-  cur->str += written_chars;
+// encoded_size gives the exact number of bytes encode_bencode writes for a
+// value, so callers allocate once and can't overflow.
 
-  char *str = string->str;
-  for (int i=0; i < length; i++) {
-    *(cur->str++) = *(str++);
+int decimal_digits(uint64_t n) {
+  int digits = 1;
+  while (n >= 10000) {
+    n /= 10000;
+    digits += 4;
   }
+  if (n >= 1000) return digits + 3;
+  if (n >= 100) return digits + 2;
+  if (n >= 10) return digits + 1;
+  return digits;
+}
+
+static const char DIGIT_PAIRS[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+// Write n in decimal, two digits at a time from the end
+void encode_decimal(uint64_t n, Cursor *cur) {
+  int digits = decimal_digits(n);
+  char *p = cur->str + digits;
+  while (n >= 100) {
+    p -= 2;
+    memcpy(p, DIGIT_PAIRS + (n % 100) * 2, 2);
+    n /= 100;
+  }
+  if (n >= 10) {
+    p -= 2;
+    memcpy(p, DIGIT_PAIRS + n * 2, 2);
+  } else {
+    *--p = '0' + n;
+  }
+  cur->str += digits;
+}
+
+uint64_t magnitude(int64_t number) {
+  return number < 0 ? (uint64_t)(-(number + 1)) + 1 : (uint64_t)number;
+}
+
+void encode_str(String* string, Cursor *cur) {
+  encode_decimal(string->length, cur);
+  *cur->str++ = ':';
+  memcpy(cur->str, string->str, string->length);
+  cur->str += string->length;
 }
 
 void encode_number(int64_t number, Cursor *cur) {
-  int written_chars = sprintf(cur->str, "i%llde", number);
-  cur->str += written_chars;
+  *cur->str++ = 'i';
+  if (number < 0) *cur->str++ = '-';
+  encode_decimal(magnitude(number), cur);
+  *cur->str++ = 'e';
 }
 
 void encode_list(LinkedList* list, Cursor *cur) {
@@ -30,22 +77,49 @@ void encode_list(LinkedList* list, Cursor *cur) {
   cur->str++;
 }
 
-void encode_dict(LinkedList *dict, Cursor *cur) {
+void encode_dict(Dict *dict, Cursor *cur) {
   *cur->str = 'd';
   cur->str++;
-  while (dict != NULL) {
-    if (!assert_type(dict->val, TKeyVal, "[encode_dict] Expected Keyval entries in dict")) {
-      exit(1);
-    }
-    KeyVal *kv = dict->val->val.kv;
+  for (int i = 0; i < dict->length; i++) {
+    KeyVal *kv = dict->entries + i;
     encode_str(kv->key, cur);
     encode_bencode(kv->val, cur);
-    dict = dict->next;
   }
   *cur->str = 'e';
   cur->str++;
 }
 
+size_t encoded_string_size(String *string) {
+  return decimal_digits(string->length) + 1 + string->length;
+}
+
+size_t encoded_size(Value *val) {
+  switch (val->type) {
+  case TString:
+    return encoded_string_size(val->val.string);
+  case TInteger:
+    return 2 + (val->val.integer < 0) + decimal_digits(magnitude(val->val.integer));
+  case TList: {
+    size_t size = 2;
+    for (LinkedList *list = val->val.list; list != NULL; list = list->next) {
+      size += encoded_size(list->val);
+    }
+    return size;
+  }
+  case TDict: {
+    size_t size = 2;
+    Dict *dict = val->val.dict;
+    for (int i = 0; i < dict->length; i++) {
+      size += encoded_string_size(dict->entries[i].key) + encoded_size(dict->entries[i].val);
+    }
+    return size;
+  }
+  default:
+    fprintf(stderr, "[encoded_size] Value type is unexpected: %d\n", val->type);
+    exit(1);
+  }
+}
+
 void encode_bencode(Value *val, Cursor *cur) {
   switch (val->type) {
   case TString:
@@ -58,7 +132,7 @@ void encode_bencode(Value *val, Cursor *cur) {
     encode_list(val->val.list, cur);
     break;
   case TDict:
-    encode_dict(val->val.list, cur);
+    encode_dict(val->val.dict, cur);
     break;
   default:
     fprintf(
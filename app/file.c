@@ -33,17 +33,33 @@ String *read_file_to_string(const char *path) {
   }
 }
 
-Value *read_torrent_file(const char* path) {
-  String *buffer = read_file_to_string(path);
-  if (buffer == NULL) {
+// Initializes arena, which holds the returned tree until arena_free. Done
+// even on failure. Strings of the tree point into the file contents, which
+// are read into the arena too
+Value *read_torrent_file(const char* path, Arena *arena) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Can't open file %s\n", path);
+    arena_init(arena, 0);
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  long length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  // Room for the nodes after the contents, in the same chunk
+  arena_init(arena, length + 64 * 1024);
+  char *source = arena_alloc(arena, length + 1);
+  bool read_ok = fread(source, length, 1, file) == 1;
+  fclose(file);
+  if (!read_ok) {
+    fprintf(stderr, "Couldn't read file %s\n", path);
     return NULL;
   }
+  source[length] = '\0';
 
-  char *buffer_start = buffer->str;
-  Cursor cur = { .str = buffer->str };
+  Cursor cur = { .str = source, .arena = arena, .borrow_strings = true };
   Value *torrent = decode_bencode(&cur);
-  free(buffer->str);
-  free(buffer);
 
   if (!assert_type(torrent, TDict, "Torrent file is not a valid bencode dictionary")) return NULL;
 
@@ -82,22 +82,17 @@ void json_pprint_(Value *val, bool pretty, int indent, bool no_first_indent) {
     printf("{");
     if (pretty) printf("\n");
 
-    LinkedList* list = val->val.list;
-    while (list != NULL) {
-      if (list->val->type != TKeyVal) {
-        fprintf(stderr, "ERROR: Expected Keyval in a dictionary. Got: %d", list->val->type);
-        exit(1);
-      }
-      KeyVal *kv = list->val->val.kv;
+    Dict *dict = val->val.dict;
+    for (int i = 0; i < dict->length; i++) {
+      KeyVal *kv = dict->entries + i;
       pindent(next_indent);
       pprint_str(kv->key);
       printf(":");
       json_pprint_(kv->val, pretty, next_indent, true);
-      if (list->next != NULL) {
+      if (i + 1 < dict->length) {
         printf(",");
       }
       if (pretty) printf("\n");
-      list = list->next;
     }
     pindent(indent);
     printf("}");
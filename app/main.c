@@ -10,9 +10,15 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <signal.h>
 #include <time.h>
+#include <unistd.h>
 #include "app.h"
 
+void request_stop(int signum) {
+  STOP_REQUESTED = 1;
+}
+
 void print_help() {
   printf("Usage: torrent-client <command> <args>\n");
   printf("Commands:\n");
@@ -20,10 +26,15 @@ void print_help() {
   printf("  info <torrent-file>     Show info about the torrent file.\n");
   printf("  download <torrent-file> <output-file>\n");
   printf("      Download file from torrent to output-file location\n");
+  printf("  recheck <torrent-file> <file> [threads]\n");
+  printf("      Verify existing data. Download then skips the good pieces\n");
+  printf("  bench-sha1 <MiB>        Measure SHA1 throughput of each implementation\n");
 }
 
 int main(int argc, char *argv[]) {
     srand(time(NULL));
+    // A peer closing its socket must show up as a send() error, not kill us
+    signal(SIGPIPE, SIG_IGN);
     if (argc < 3) {
         fprintf(stderr, "Invalid command usage \n");
         print_help();
@@ -37,9 +48,12 @@ int main(int argc, char *argv[]) {
 
     } else if (strcmp(command, "decode") == 0) {
         char *encoded_str = argv[2];
-        Cursor cur = {.str = encoded_str};
+        Arena arena;
+        arena_init(&arena, strlen(encoded_str) * 2);
+        Cursor cur = {.str = encoded_str, .arena = &arena};
         Value *val = decode_bencode(&cur);
         json_print(val);
+        arena_free(&arena);
 
     } else if (strcmp(command, "info") == 0) {
         const char *path = argv[2];
@@ -47,8 +61,9 @@ int main(int argc, char *argv[]) {
         if (buffer == NULL) {
           return 1;
         }
-        char *buffer_start = buffer->str;
-        Cursor cur = { .str = buffer->str };
+        Arena arena;
+        arena_init(&arena, buffer->length);
+        Cursor cur = { .str = buffer->str, .arena = &arena, .borrow_strings = true };
         Value *torrent = decode_bencode(&cur);
         if (!assert_type(torrent, TDict, "Torrent file is not a valid bencode dictionary")) return 1;
 
@@ -59,7 +74,7 @@ int main(int argc, char *argv[]) {
         if (!assert_type(info, TDict, "Torrent info is not a Dict")) return 1;
 
         uint64_t length = torrent_total_length(info);
-        printf("Tracker URL: %s\n", announce->val.string->str);
+        printf("Tracker URL: %.*s\n", announce->val.string->length, announce->val.string->str);
         printf("Length: %lld\n", length);
 
         Value *files = gethash(info, "files");
@@ -69,15 +84,11 @@ int main(int argc, char *argv[]) {
         }
 
         // Info Hash
-        Cursor cur2 = {.str = buffer_start};
-        char sha_out[20];
-
-        encode_bencode(info, &cur2);
-        SHA1(sha_out, buffer_start, cur2.str - buffer_start);
-
+        String hash_string = info_hash(torrent);
         printf("Info Hash: ");
-        pprint_hex((uint8_t *)sha_out, 20);
+        pprint_hex((uint8_t *)hash_string.str, 20);
         printf("\n");
+        free(hash_string.str);
 
         // Piece Length and Hashes
         Value *piece_length = gethash(info, "piece length");
@@ -97,9 +108,13 @@ int main(int argc, char *argv[]) {
             offset += 20;
           }
         }
+        arena_free(&arena);
+        free(buffer->str);
+        free(buffer);
 
     } else if (strcmp(command, "peers") == 0) {
-        Value *torrent = read_torrent_file(argv[2]);
+        Arena arena;
+        Value *torrent = read_torrent_file(argv[2], &arena);
         if (torrent == NULL) return 1;
 
         String hash = info_hash(torrent);
@@ -113,11 +128,13 @@ int main(int argc, char *argv[]) {
           pprint_sockaddr(*p);
           p++;
         }
+        arena_free(&arena);
 
     } else if (strcmp(command, "handshake") == 0) {
         if (argc < 4) return 1;
 
-        Value *torrent = read_torrent_file(argv[2]);
+        Arena arena;
+        Value *torrent = read_torrent_file(argv[2], &arena);
         if (torrent == NULL) return 1;
 
         // Get ip and port from command line
@@ -128,7 +145,6 @@ int main(int argc, char *argv[]) {
 
         // create and connect peer
         Peer p = create_peer(0, t.n_pieces, 10 * 1024);
-        p.recvbuffer = malloc(p.buffer_size);
         connect_peer(&p, peer_addr);
 
         // start communication loop
@@ -152,6 +168,7 @@ int main(int argc, char *argv[]) {
         printf("Peer ID: ");
         pprint_hex((uint8_t *)peer_id.str, peer_id.length);
         printf("\n");
+        arena_free(&arena);
 
     } else if (strcmp(command, "download_piece") == 0) {
         // 1. Parse args
@@ -165,7 +182,8 @@ int main(int argc, char *argv[]) {
         }
 
         // 2. Read torrent file
-        Value *torrent = read_torrent_file(input_file);
+        Arena arena;
+        Value *torrent = read_torrent_file(input_file, &arena);
         Torrent t = create_torrent(torrent);
 
         // 3. Get peer addresses
@@ -194,7 +212,8 @@ int main(int argc, char *argv[]) {
         Peer *p = peers;
         struct sockaddr_in *addr = peer_addrs;
         int failed_peers = 0;
-        int buffer_size = 20 * 16 * 1024; // Enough size of 20 blocks of 16 kiB
+        // Largest message kept in recvbuffer is BITFIELD. Blocks go straight to their piece
+        int buffer_size = ceil_division(t.n_pieces, 8) + 1024;
         for (int idx=0; idx<n_peers; idx++) {
           *p = create_peer(idx, t.n_pieces, buffer_size);
           if (connect_peer(p, *addr)) {
@@ -241,6 +260,7 @@ int main(int argc, char *argv[]) {
           free_peer(peers + idx);
         }
         free_torrent(&t);
+        arena_free(&arena);
         return 0;
 
     } else if (strcmp(command, "download") == 0) {
@@ -254,7 +274,8 @@ int main(int argc, char *argv[]) {
         char *output_path = argv[3];
 
         // 2. Read torrent file
-        Value* torrent = read_torrent_file(input_path);
+        Arena arena;
+        Value* torrent = read_torrent_file(input_path, &arena);
         Torrent t = create_torrent(torrent);
         json_pprint(torrent);
 
@@ -276,15 +297,38 @@ int main(int argc, char *argv[]) {
           }
         }
 
-        // 5. Open file
-        FILE *file = fopen(output_path, "wb");
-        if (file == NULL) {
-          fprintf(stdout, "Coulndn't open output file %s\n", output_path);
+        // 5. Map the output files. A multi-file torrent goes into the
+        // directory output_path. Files are opened as pieces reach them, and
+        // read back by sendfile() when uploading, and when resuming
+        Storage *storage = storage_create(gethash_safe(torrent, "info", TDict), output_path, false);
+        if (storage == NULL) {
+          fprintf(stdout, "Coulndn't map output files to %s\n", output_path);
           return 1;
         }
         FILE *log = fopen("/tmp/log", "w");
         t.summary_file = log;
-        t.output_file = file;
+        t.storage = storage;
+        t.use_io_uring = getenv("TORRENT_IO_URING") != NULL;
+        // MiB that pieces being downloaded may take
+        char *piece_memory = getenv("TORRENT_PIECE_MEMORY");
+        if (piece_memory != NULL) t.piece_memory = strtoull(piece_memory, NULL, 10) * 1024 * 1024;
+
+        // Pick up where an earlier run stopped. Without a resume file the
+        // download starts over
+        size_t resume_path_size = strlen(output_path) + sizeof(".resume");
+        t.resume_path = malloc(resume_path_size);
+        snprintf(t.resume_path, resume_path_size, "%s.resume", output_path);
+        if (load_resume(&t) == -1) storage_truncate(storage);
+
+        // Recieve pieces straight into a mapping of the output file
+        if (getenv("TORRENT_MMAP") != NULL && !storage_map(storage)) {
+          printf("Can't map the output. Writing it piece by piece\n");
+        }
+
+        // Ctrl-C stops the download and saves the resume file
+        struct sigaction stop_action = {.sa_handler = request_stop};
+        sigaction(SIGINT, &stop_action, NULL);
+        sigaction(SIGTERM, &stop_action, NULL);
 
         // 6. Create and connect Peers
         Peer *peers = malloc(sizeof(Peer) * n_peers);
@@ -292,7 +336,8 @@ int main(int argc, char *argv[]) {
         Peer *p = peers;
         struct sockaddr_in *addr = peer_addrs;
         int failed_peers = 0;
-        int buffer_size = 20 * 16 * 1024; // Enough size of 20 blocks of 16 kiB
+        // Largest message kept in recvbuffer is BITFIELD. Blocks go straight to their piece
+        int buffer_size = ceil_division(t.n_pieces, 8) + 1024;
         for (int idx=0; idx<n_peers; idx++) {
           *p = create_peer(idx, t.n_pieces, buffer_size);
           if (connect_peer(p, *addr)) {
@@ -306,17 +351,70 @@ int main(int argc, char *argv[]) {
 
         // 7. Start communication
         start_communication_loop(peers, n_peers, &t);
+        save_resume(&t, true);
 
         // 8. Free
         for (int idx=0; idx<n_peers; idx++) {
           free_peer(peers + idx);
         }
         free_torrent(&t);
+        arena_free(&arena);
 
         // 9. Close. Done.
-        fclose(file);
-        printf("Downloaded %d pieces to %s\n", t.n_pieces, output_path);
-        return 0;
+        storage_free(storage);
+        free(t.resume_path);
+        printf("Downloaded %d of %d pieces to %s\n", t.downloaded_pieces, t.n_pieces, output_path);
+        return t.disk_failed ? 1 : 0;
+
+    } else if (strcmp(command, "recheck") == 0) {
+        if (argc < 4) {
+          fprintf(stderr, "recheck arguments insufficient. \n");
+          print_help();
+          return 1;
+        }
+        char *path = argv[3];
+        int n_threads = argc >= 5 ? atoi(argv[4]) : 0;
+
+        Arena arena;
+        Value *torrent = read_torrent_file(argv[2], &arena);
+        if (torrent == NULL) return 1;
+        Torrent t = create_torrent(torrent);
+
+        Storage *storage = storage_create(gethash_safe(torrent, "info", TDict), path, true);
+        if (storage == NULL) {
+          fprintf(stderr, "Can't map files to %s\n", path);
+          return 1;
+        }
+        t.storage = storage;
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        uint8_t *verified = recheck_pieces(&t, NULL, n_threads);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (verified == NULL) {
+          // Nothing was read, so there is nothing to record in a resume file
+          free_torrent(&t);
+          arena_free(&arena);
+          storage_free(storage);
+          return 1;
+        }
+        float seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        int good = apply_recheck(&t, verified);
+        printf("%d of %d pieces OK. Checked in %.2f s (%.1f MiB/s)\n", good, t.n_pieces, seconds,
+               t.file_length / (1024.0 * 1024.0) / seconds);
+
+        // Picked up by download of the same file
+        size_t resume_path_size = strlen(path) + sizeof(".resume");
+        t.resume_path = malloc(resume_path_size);
+        snprintf(t.resume_path, resume_path_size, "%s.resume", path);
+        save_resume(&t, true);
+
+        free(verified);
+        free(t.resume_path);
+        free_torrent(&t);
+        arena_free(&arena);
+        storage_free(storage);
+        return good == t.n_pieces ? 0 : 2;
 
     } else if (strcmp(command, "info-all") == 0) {
         const char *path = argv[2];
@@ -325,21 +423,30 @@ int main(int argc, char *argv[]) {
           fprintf(stderr, "Invalid file: %s\n", path);
           return 1;
         }
-        Cursor cur = { .str = buffer->str };
+        Arena arena;
+        arena_init(&arena, buffer->length * 2);
+        Cursor cur = { .str = buffer->str, .arena = &arena };
         json_pprint(decode_bencode(&cur));
+        arena_free(&arena);
+
+    } else if (strcmp(command, "bench-sha1") == 0) {
+        return SHA1Benchmark(strtol(argv[2], NULL, 10));
 
     } else if (strcmp(command, "encode-decode") == 0) {
         char *encoded_str = argv[2];
 
-        Cursor cur = {.str = encoded_str};
+        Arena arena;
+        arena_init(&arena, strlen(encoded_str) * 2);
+        Cursor cur = {.str = encoded_str, .arena = &arena};
         Value *val = decode_bencode(&cur);
         json_pprint(val);
 
-        char *buffer = malloc(strlen(encoded_str) + 1);
+        char *buffer = malloc(encoded_size(val) + 1);
         Cursor cur2 = { .str = buffer };
         encode_bencode(val, &cur2);
         *cur2.str = '\0';
         printf("%s\n", buffer);
+        arena_free(&arena);
 
     } else {
         fprintf(stderr, "Unknown command: %s\n", command);
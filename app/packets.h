@@ -8,10 +8,21 @@ void send_bitfield(Torrent *t, Peer *p);
 void send_interested(Peer *peer);
 void send_unchoke(Peer *peer);
 void send_keepalive(Peer *peer);
+void send_request(Peer *peer, uint32_t index, uint32_t begin, uint32_t length);
+void send_cancel(Peer *peer, uint32_t index, uint32_t begin, uint32_t length);
+void send_have(Peer *peer, uint32_t index);
+bool queue_upload(Peer *p, UploadRequest request);
+bool cancel_upload(Peer *p, UploadRequest request);
+void flush_peer_output(Peer *p, Torrent *t);
 
 // packets_recieve.c
+uint8_t *create_recvbuffer(int size);
+void free_recvbuffer(uint8_t *ring, int size);
+uint8_t *recvbuffer_head(Peer *p);
+void consume_recvbuffer(Peer *p, int bytes);
 int peer_recv(Peer *p);
+int peer_recv_bytes(Peer *p, uint8_t *data, int len);
+void peer_recv_block(Peer *p, uint8_t *dst, uint32_t length);
 Message pop_message(Peer *p);
-void shift_recvbuffer(Peer *p);
 
 #endif
@@ -1,13 +1,105 @@
+#define _GNU_SOURCE
 #include "app.h"
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #define DEBUG false
 #define DEBUG_MSG false
 #define DEBUG_MSG_BYTES false
 
+// Sink for PIECE payloads that are dropped
+uint8_t discard_buffer[16 * 1024];
+
+void account_recieved_bytes(Peer *p, int bytes) {
+  p->last_msg_time = NOW;
+  p->speed_bytes_recieved += bytes;
+}
+
+// recvbuffer is a ring of size bytes (a multiple of the page size) that is
+// mapped twice back to back. Any size bytes starting inside the first mapping
+// are contiguous in memory, so messages and free space never have to be split
+// at the wrap, and nothing is ever moved.
+//
+// recv_bytes and processed_bytes count bytes written and consumed. Both are
+// taken modulo buffer_size for positions, and lowered together once a whole
+// lap has been consumed.
+uint8_t *create_recvbuffer(int size) {
+  int fd = memfd_create("recvbuffer", MFD_CLOEXEC);
+  if (fd == -1 || ftruncate(fd, size) == -1) {
+    fprintf(stderr, "Couldn't create recvbuffer: %d %s\n", errno, strerror(errno));
+    exit(1);
+  }
+  uint8_t *ring = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED ||
+      mmap(ring, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+      mmap(ring + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    fprintf(stderr, "Couldn't map recvbuffer: %d %s\n", errno, strerror(errno));
+    exit(1);
+  }
+  close(fd);
+  return ring;
+}
+
+void free_recvbuffer(uint8_t *ring, int size) {
+  munmap(ring, 2 * size);
+}
+
+// Next unprocessed byte
+uint8_t *recvbuffer_head(Peer *p) {
+  return p->recvbuffer + p->processed_bytes % p->buffer_size;
+}
+
+void consume_recvbuffer(Peer *p, int bytes) {
+  p->processed_bytes += bytes;
+  if (p->processed_bytes >= p->buffer_size) {
+    p->processed_bytes -= p->buffer_size;
+    p->recv_bytes -= p->buffer_size;
+  }
+}
+
+int recvbuffer_free(Peer *p) {
+  return p->buffer_size - (p->recv_bytes - p->processed_bytes);
+}
+
+// Bytes of the current block that arrived
+void advance_block(Peer *p, int bytes) {
+  if (p->block_dst != NULL) p->block_dst += bytes;
+  p->block_remaining -= bytes;
+}
+
+// While a block is being recieved, its payload is read straight into the piece
+// (or discard_buffer) and anything after it into recvbuffer, with one readv
 int peer_recv(Peer *p) {
-  size_t bytes = recv(p->sock, p->recvbuffer + p->recv_bytes, p->buffer_size - p->recv_bytes, 0);
-  if (bytes == -1) {
+  struct iovec iov[2];
+  int n_iov = 0;
+  uint32_t block_bytes = 0;
+  if (p->block_remaining > 0) {
+    block_bytes = p->block_remaining;
+    if (p->block_dst == NULL && block_bytes > sizeof(discard_buffer)) block_bytes = sizeof(discard_buffer);
+    iov[n_iov].iov_base = p->block_dst != NULL ? p->block_dst : discard_buffer;
+    iov[n_iov].iov_len = block_bytes;
+    n_iov++;
+  }
+  // Only once the block is complete do the following bytes belong to recvbuffer
+  if (block_bytes == p->block_remaining) {
+    if (recvbuffer_free(p) == 0) {
+      fprintf(stderr, "recvbuffer of peer %d is full\n", p->peer_idx);
+      p->stage = S_ERROR;
+      return 0;
+    }
+    iov[n_iov].iov_base = p->recvbuffer + p->recv_bytes % p->buffer_size;
+    iov[n_iov].iov_len = recvbuffer_free(p);
+    n_iov++;
+  }
+
+  ssize_t bytes = readv(p->sock, iov, n_iov);
+  if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    // Socket drained
+    return 0;
+  } else if (bytes == -1) {
     fprintf(stderr, "Error occured while recv: %d %s\n", errno, strerror(errno));
     p->stage = S_ERROR;
     return 0;
@@ -17,15 +109,54 @@ int peer_recv(Peer *p) {
     return 0;
   }
 
-  if (DEBUG_MSG_BYTES) printf("  Recieved %zu bytes from %d at %d\n", bytes, p->peer_idx, p->sock);
-  p->recv_bytes += bytes;
-  p->last_msg_time = NOW;
-  if (p->piece != NULL) {
-    p->piece->speed_bytes_recieved += bytes;
+  if (DEBUG_MSG_BYTES) printf("  Recieved %zd bytes from %d at %d\n", bytes, p->peer_idx, p->sock);
+  uint32_t to_block = bytes < block_bytes ? bytes : block_bytes;
+  advance_block(p, to_block);
+  p->recv_bytes += bytes - to_block;
+  account_recieved_bytes(p, bytes);
+  return bytes;
+}
+
+// Take bytes that were already read from the socket (by io_uring). They go to
+// the current block, or else to recvbuffer. Returns how many were taken, which
+// is less than len when the block is complete or recvbuffer is full, so the
+// caller has to process messages and hand over the rest again.
+int peer_recv_bytes(Peer *p, uint8_t *data, int len) {
+  if (p->block_remaining > 0) {
+    int bytes = len < p->block_remaining ? len : p->block_remaining;
+    if (p->block_dst != NULL) memcpy(p->block_dst, data, bytes);
+    advance_block(p, bytes);
+    account_recieved_bytes(p, bytes);
+    return bytes;
+  }
+
+  int bytes = recvbuffer_free(p);
+  if (bytes > len) bytes = len;
+  if (bytes == 0) {
+    fprintf(stderr, "recvbuffer of peer %d is full\n", p->peer_idx);
+    p->stage = S_ERROR;
+    return 0;
   }
+
+  if (DEBUG_MSG_BYTES) printf("  Recieved %d bytes from %d at %d\n", bytes, p->peer_idx, p->sock);
+  memcpy(p->recvbuffer + p->recv_bytes % p->buffer_size, data, bytes);
+  p->recv_bytes += bytes;
+  account_recieved_bytes(p, bytes);
   return bytes;
 }
 
+// Recieve the payload of the PIECE message that was just popped into dst, or
+// drop it when dst is NULL. Bytes already in recvbuffer are used first, the
+// rest arrives through peer_recv or peer_recv_bytes.
+void peer_recv_block(Peer *p, uint8_t *dst, uint32_t length) {
+  uint32_t buffered = p->recv_bytes - p->processed_bytes;
+  if (buffered > length) buffered = length;
+  if (dst != NULL) memcpy(dst, recvbuffer_head(p), buffered);
+  consume_recvbuffer(p, buffered);
+  p->block_dst = dst == NULL ? NULL : dst + buffered;
+  p->block_remaining = length - buffered;
+}
+
 Message pop_message(Peer *p) {
   if (DEBUG_MSG) printf("  Poping messgage. {.processed = %d, .recieved = %d }\n", p->processed_bytes, p->recv_bytes);
 
@@ -37,17 +168,32 @@ Message pop_message(Peer *p) {
     return msg;
   }
 
-  uint8_t *buffer = p->recvbuffer + p->processed_bytes;
+  uint8_t *buffer = recvbuffer_head(p);
+  int available = p->recv_bytes - p->processed_bytes;
+  if (available < 4) {
+    msg.type = MSG_INCOMPLETE;
+    return msg;
+  }
   uint32_t msg_len = read_uint32(buffer, 0);
 
   if (msg_len == 0) { // Keepalive msg
     if (DEBUG_MSG) printf("    Popped KEEPALIVE messgage\n");
 
     msg.type = MSG_KEEPALIVE;
-    p->processed_bytes += 4;
+    consume_recvbuffer(p, 4);
     return msg;
 
-  } else if (p->recv_bytes - p->processed_bytes < msg_len + 4) {
+  } else if (msg_len >= 9 && available >= 13 && buffer[4] == MSG_PIECE) {
+    // Only the header. The block itself is left for peer_recv_block
+    msg.type = MSG_PIECE;
+    msg.length = msg_len - 1;
+    msg.payload = buffer + 5;
+    if (DEBUG_MSG) printf("\tPopped PIECE header: {.length=%u}\n", msg.length);
+
+    consume_recvbuffer(p, 13);
+    return msg;
+
+  } else if (available < msg_len + 4) {
     if (DEBUG_MSG) printf("    Full data of message not recieved. Required: %u, Got: %d\n", msg_len + 4, p->recv_bytes - p->processed_bytes);
     msg.type = MSG_INCOMPLETE;
     msg.length = 0;
@@ -62,39 +208,10 @@ Message pop_message(Peer *p) {
 
     if (DEBUG_MSG) printf("\tPopped messgage: {.length=%u, .type=%d}\n", msg.length, msg.type);
     if (DEBUG_MSG_BYTES) {
-      printf("\t\t"); pprint_hex(p->recvbuffer + p->processed_bytes, msg_len + 4); printf("\n");
+      printf("\t\t"); pprint_hex(buffer, msg_len + 4); printf("\n");
     }
 
-    p->processed_bytes += msg_len + 4;
+    consume_recvbuffer(p, msg_len + 4);
     return msg;
   }
 }
-
-void shift_recvbuffer(Peer *p) {
-  if (p->recv_bytes == p->processed_bytes) {
-    p->recv_bytes = 0;
-    p->processed_bytes = 0;
-  } else if (p->recv_bytes > 3 * p->buffer_size / 2) {
-    if (DEBUG) {
-      printf("Shifting recvbuffer of peer: %d\n", p->peer_idx);
-      printf("[recvbuffer] recv_bytes: %d, processed_bytes: %d, buffer_size: %d\n", p->recv_bytes, p->processed_bytes, p->buffer_size);
-    }
-
-    if (p->processed_bytes > 0) {
-      int bytes_to_shift = p->recv_bytes - p->processed_bytes;
-      uint8_t *from = p->recvbuffer + p->processed_bytes;
-      uint8_t *to = p->recvbuffer;
-      p->recv_bytes -= bytes_to_shift;
-      p->processed_bytes -= bytes_to_shift;
-      while (bytes_to_shift > 0) {
-        *(to++) = *(from++);
-        bytes_to_shift--;
-      }
-      if (DEBUG) {
-        printf("shifted to recv_bytes: %d, processed_bytes: %d, buffer_size: %d\n", p->recv_bytes, p->processed_bytes, p->buffer_size);
-      }
-    }
-  } else {
-    if (DEBUG) printf("[recvbuffer] recv_bytes: %d, processed_bytes: %d, buffer_size: %d\n", p->recv_bytes, p->processed_bytes, p->buffer_size);
-  }
-}
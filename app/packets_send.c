@@ -1,6 +1,8 @@
 #include "app.h"
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 
 #define DEBUG false
 #define DEBUG_MSG_BYTES false
@@ -39,24 +41,40 @@ void send_msg(Peer *p, Message msg) {
   }
 
   p->last_msg_time = NOW;
-  if (msg.type == MSG_KEEPALIVE) { //
-    send(p->sock, "\0\0\0\0", 4, 0);
-  } else if (msg.length == 0) {
-    uint8_t buffer[5] = {0};
-    buffer[3] = 1;
-    buffer[4] = msg.type;
-    send(p->sock, buffer, 5, 0);
+  uint8_t buffer[5 + msg.length];
+  int expected;
+  if (msg.type == MSG_KEEPALIVE) {
+    memset(buffer, 0, 4);
+    expected = 4;
   } else {
-    uint8_t buffer[5 + msg.length];
     *(uint32_t *)buffer = htonl(msg.length + 1);
     buffer[4] = msg.type;
-    memcpy(buffer + 5, msg.payload, msg.length);
-    size_t sent = send(p->sock, buffer, msg.length + 5, 0);
-    if (sent != msg.length + 5) {
-      fprintf(stderr, "[TODO] Couln't send whole message. Tried: %u, Sent: %zu\n",  msg.length + 5, sent);
-      exit(1);
+    if (msg.length > 0) memcpy(buffer + 5, msg.payload, msg.length);
+    expected = msg.length + 5;
+  }
+
+  // Keep the order of the stream. Nothing may cut into a queued message or a
+  // block being uploaded
+  ssize_t sent = 0;
+  if (p->send_bytes == 0 && p->upload_sent == 0) {
+    sent = send(p->sock, buffer, expected, 0);
+    if (sent == expected) return;
+    if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      fprintf(stderr, "Couldn't send message to peer %d. %s\n", p->peer_idx, strerror(errno));
+      p->stage = S_ERROR;
+      return;
     }
+    if (sent == -1) sent = 0;
+    p->write_blocked = true;
   }
+
+  if (p->send_bytes + expected - sent > p->sendbuffer_size) {
+    fprintf(stderr, "sendbuffer of peer %d is full\n", p->peer_idx);
+    p->stage = S_ERROR;
+    return;
+  }
+  memcpy(p->sendbuffer + p->send_bytes, buffer + sent, expected - sent);
+  p->send_bytes += expected - sent;
 }
 
 void send_bitfield(Torrent *t, Peer *p) {
@@ -64,7 +82,7 @@ void send_bitfield(Torrent *t, Peer *p) {
   uint8_t bits[bytes];
   memset(bits, 0, bytes);
   for (int i=0; i<t->n_pieces; i++) {
-    int have = t->pieces[i].state == PS_DOWNLOADED;
+    int have = t->pieces[i].state == PS_FLUSHED;
     setf_bit(bits, bytes, i, have);
   }
   Message msg = { .type = MSG_BITFIELD, .length = bytes, .payload = bits};
@@ -88,3 +106,115 @@ void send_keepalive(Peer *peer) {
   Message keepalive = { .type = MSG_KEEPALIVE, .length = 0, .payload = NULL};
   send_msg(peer, keepalive);
 }
+
+void send_request(Peer *peer, uint32_t index, uint32_t begin, uint32_t length) {
+  if (DEBUG) printf("Sending REQUEST: Peer %d, Piece %d, Begin %d\n", peer->peer_idx, index, begin);
+  uint32_t payload[3] = {htonl(index), htonl(begin), htonl(length)};
+  Message request = {.length = 3 * 4, .type = MSG_REQUEST, .payload = payload};
+  send_msg(peer, request);
+}
+
+void send_cancel(Peer *peer, uint32_t index, uint32_t begin, uint32_t length) {
+  if (DEBUG) printf("Sending CANCEL: Peer %d, Piece %d, Begin %d\n", peer->peer_idx, index, begin);
+  uint32_t payload[3] = {htonl(index), htonl(begin), htonl(length)};
+  Message cancel = {.length = 3 * 4, .type = MSG_CANCEL, .payload = payload};
+  send_msg(peer, cancel);
+}
+
+void send_have(Peer *peer, uint32_t index) {
+  if (DEBUG) printf("Sending HAVE: Peer %d, Piece %d\n", peer->peer_idx, index);
+  uint32_t payload = htonl(index);
+  Message have = {.length = 4, .type = MSG_HAVE, .payload = &payload};
+  send_msg(peer, have);
+}
+
+// Returns false when the upload queue is full
+bool queue_upload(Peer *p, UploadRequest request) {
+  if (p->n_uploads == MAX_UPLOAD_REQUESTS) return false;
+  p->uploads[(p->upload_head + p->n_uploads) % MAX_UPLOAD_REQUESTS] = request;
+  p->n_uploads++;
+  return true;
+}
+
+// Drop a queued request. The one already going out can't be taken back
+bool cancel_upload(Peer *p, UploadRequest request) {
+  for (int i = p->upload_sent > 0 ? 1 : 0; i < p->n_uploads; i++) {
+    UploadRequest *r = &p->uploads[(p->upload_head + i) % MAX_UPLOAD_REQUESTS];
+    if (r->index == request.index && r->begin == request.begin && r->length == request.length) {
+      // Close the gap
+      for (int j = i; j < p->n_uploads - 1; j++) {
+        p->uploads[(p->upload_head + j) % MAX_UPLOAD_REQUESTS] = p->uploads[(p->upload_head + j + 1) % MAX_UPLOAD_REQUESTS];
+      }
+      p->n_uploads--;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Send queued messages, then queued uploads, until the socket refuses more.
+// A block goes out as a PIECE header followed by sendfile() from the files
+// it is stored in, so its data never passes through user space.
+void flush_peer_output(Peer *p, Torrent *t) {
+  p->write_blocked = false;
+  while (p->stage < S_ERROR) {
+    ssize_t sent;
+    if (p->upload_sent > 0 || (p->send_bytes == 0 && p->n_uploads > 0)) {
+      UploadRequest *r = &p->uploads[p->upload_head];
+      if (p->upload_sent < 13) {
+        uint8_t header[13];
+        *(uint32_t *)header = htonl(9 + r->length);
+        header[4] = MSG_PIECE;
+        *(uint32_t *)(header + 5) = htonl(r->index);
+        *(uint32_t *)(header + 9) = htonl(r->begin);
+        sent = send(p->sock, header + p->upload_sent, 13 - p->upload_sent, MSG_MORE);
+      } else {
+        // One file at a time when the block spans several
+        uint32_t done = p->upload_sent - 13;
+        StorageSpan span;
+        if (!storage_acquire_span(t->storage, (uint64_t)r->index * t->piece_length + r->begin + done, r->length - done, &span)) {
+          fprintf(stderr, "Couldn't open file to upload piece %d: %d %s\n", r->index, errno, strerror(errno));
+          p->stage = S_ERROR;
+          return;
+        }
+        off_t offset = span.file_offset;
+        sent = span.length == 0 ? 0 : sendfile(p->sock, span.fd, &offset, span.length);
+        storage_release(t->storage, span.file_idx);
+        if (sent == 0) {
+          fprintf(stderr, "Piece %d is missing from the output file\n", r->index);
+          p->stage = S_ERROR;
+          return;
+        }
+      }
+      if (sent > 0) {
+        p->upload_sent += sent;
+        if (p->upload_sent == 13 + r->length) {
+          if (DEBUG) printf("Uploaded %d[%d] to peer %d\n", r->index, r->begin, p->peer_idx);
+          p->uploaded_bytes += r->length;
+          p->upload_head = (p->upload_head + 1) % MAX_UPLOAD_REQUESTS;
+          p->n_uploads--;
+          p->upload_sent = 0;
+        }
+        continue;
+      }
+    } else if (p->send_bytes > 0) {
+      sent = send(p->sock, p->sendbuffer, p->send_bytes, 0);
+      if (sent > 0) {
+        memmove(p->sendbuffer, p->sendbuffer + sent, p->send_bytes - sent);
+        p->send_bytes -= sent;
+        continue;
+      }
+    } else {
+      return;
+    }
+
+    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      p->write_blocked = true;
+      return;
+    }
+    if (sent == -1 && errno == EINTR) continue;
+    fprintf(stderr, "Couldn't send to peer %d. %s\n", p->peer_idx, strerror(errno));
+    p->stage = S_ERROR;
+    return;
+  }
+}
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "app.h"
+
+#define DEBUG false
+
+// Rarest first piece picker.
+//
+// availability[i] is the number of connected peers that have piece i. order
+// holds all piece indices sorted by availability, split into buckets: pieces
+// with availability k are order[bucket_start[k] .. bucket_start[k + 1]). pos is
+// the inverse of order. Moving a piece to the next or previous bucket is a
+// swap with the edge of its bucket plus a boundary shift, so updates are O(1).
+//
+// Only pieces that can be picked are in the buckets. The others are kept in
+// order[0 .. bucket_start[0]) and still have their availability counted, so
+// they go back to the right bucket if they are wanted again.
+
+void picker_init(PiecePicker *picker, int n_pieces) {
+  picker->n_pieces = n_pieces;
+  picker->availability = malloc(sizeof(uint32_t) * n_pieces);
+  picker->order = malloc(sizeof(uint32_t) * n_pieces);
+  picker->pos = malloc(sizeof(uint32_t) * n_pieces);
+  memset(picker->availability, 0, sizeof(uint32_t) * n_pieces);
+  for (int i = 0; i < n_pieces; i++) {
+    picker->order[i] = i;
+    picker->pos[i] = i;
+  }
+
+  // Single bucket 0 holding everything
+  picker->n_buckets = 1;
+  picker->bucket_start = malloc(sizeof(uint32_t) * 2);
+  picker->bucket_start[0] = 0;
+  picker->bucket_start[1] = n_pieces;
+}
+
+void picker_free(PiecePicker *picker) {
+  free(picker->availability);
+  free(picker->order);
+  free(picker->pos);
+  free(picker->bucket_start);
+}
+
+void picker_swap(PiecePicker *picker, uint32_t pos_a, uint32_t pos_b) {
+  uint32_t a = picker->order[pos_a];
+  uint32_t b = picker->order[pos_b];
+  picker->order[pos_a] = b;
+  picker->order[pos_b] = a;
+  picker->pos[b] = pos_a;
+  picker->pos[a] = pos_b;
+}
+
+// Make sure bucket k exists
+void picker_grow(PiecePicker *picker, uint32_t k) {
+  if (k < picker->n_buckets) return;
+  picker->bucket_start = realloc(picker->bucket_start, sizeof(uint32_t) * (k + 2));
+  while (picker->n_buckets <= k) {
+    picker->n_buckets++;
+    picker->bucket_start[picker->n_buckets] = picker->n_pieces;
+  }
+}
+
+bool picker_contains(PiecePicker *picker, uint32_t piece_idx) {
+  return picker->pos[piece_idx] >= picker->bucket_start[0];
+}
+
+// One more peer has piece_idx
+void picker_inc(PiecePicker *picker, uint32_t piece_idx) {
+  uint32_t k = picker->availability[piece_idx];
+  if (!picker_contains(picker, piece_idx)) {
+    picker->availability[piece_idx]++;
+    return;
+  }
+  picker_grow(picker, k + 1);
+
+  // Move to the end of bucket k, which becomes the start of bucket k + 1
+  uint32_t last = picker->bucket_start[k + 1] - 1;
+  picker_swap(picker, picker->pos[piece_idx], last);
+  picker->bucket_start[k + 1]--;
+  picker->availability[piece_idx]++;
+}
+
+// A peer that had piece_idx is gone
+void picker_dec(PiecePicker *picker, uint32_t piece_idx) {
+  uint32_t k = picker->availability[piece_idx];
+  if (k == 0) {
+    fprintf(stderr, "[BUG] availability of piece %d is already zero\n", piece_idx);
+    return;
+  }
+  if (!picker_contains(picker, piece_idx)) {
+    picker->availability[piece_idx]--;
+    return;
+  }
+
+  // Move to the start of bucket k, which becomes the end of bucket k - 1
+  uint32_t first = picker->bucket_start[k];
+  picker_swap(picker, picker->pos[piece_idx], first);
+  picker->bucket_start[k]++;
+  picker->availability[piece_idx]--;
+}
+
+// piece_idx can't be picked until picker_add. It moves down one bucket at a
+// time, so this is O(availability)
+void picker_remove(PiecePicker *picker, uint32_t piece_idx) {
+  if (!picker_contains(picker, piece_idx)) return;
+  for (int k = picker->availability[piece_idx]; k >= 0; k--) {
+    picker_swap(picker, picker->pos[piece_idx], picker->bucket_start[k]);
+    picker->bucket_start[k]++;
+  }
+}
+
+// piece_idx can be picked again, from the bucket of its availability
+void picker_add(PiecePicker *picker, uint32_t piece_idx) {
+  if (picker_contains(picker, piece_idx)) return;
+  uint32_t k = picker->availability[piece_idx];
+  picker_grow(picker, k);
+  picker_swap(picker, picker->pos[piece_idx], picker->bucket_start[0] - 1);
+  picker->bucket_start[0]--;
+  for (uint32_t j = 1; j <= k; j++) {
+    picker_swap(picker, picker->pos[piece_idx], picker->bucket_start[j] - 1);
+    picker->bucket_start[j]--;
+  }
+}
+
+// Rarest piece that peer has. Ties are broken randomly, by starting the scan
+// of each bucket at a random offset.
+Piece *picker_select(PiecePicker *picker, Piece *pieces, Peer *peer) {
+  for (uint32_t k = 1; k < picker->n_buckets; k++) {
+    uint32_t start = picker->bucket_start[k];
+    uint32_t size = picker->bucket_start[k + 1] - start;
+    if (size == 0) continue;
+
+    uint32_t offset = rand() % size;
+    for (uint32_t i = 0; i < size; i++) {
+      uint32_t piece_idx = picker->order[start + (offset + i) % size];
+      Piece *piece = pieces + piece_idx;
+      if (aref_bit(peer->bitmap, peer->bitmap_size, piece_idx)) {
+        if (DEBUG) printf("Picked piece %d with availability %d\n", piece_idx, k);
+        return piece;
+      }
+    }
+  }
+  return NULL;
+}
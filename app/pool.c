@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "app.h"
+
+#define DEBUG false
+
+// Fixed-size slots for the pieces being downloaded. A slot holds a piece's
+// buffer and its block maps, so activating a piece is one pop from the free
+// list instead of three mallocs. Slots are allocated the first time they are
+// needed and reused after that. There are never more than max_slots, which
+// bounds the memory downloads take however many peers there are.
+
+void pool_init(PiecePool *pool, size_t slot_size, int max_slots) {
+  pool->slot_size = slot_size;
+  pool->max_slots = max_slots < 1 ? 1 : max_slots;
+  pool->n_slots = 0;
+  pool->n_free = 0;
+  pool->slots = malloc(sizeof(uint8_t *) * pool->max_slots);
+  pool->free_slots = malloc(sizeof(uint8_t *) * pool->max_slots);
+  pool->starved = false;
+}
+
+void pool_free(PiecePool *pool) {
+  for (int i = 0; i < pool->n_slots; i++) {
+    free(pool->slots[i]);
+  }
+  free(pool->slots);
+  free(pool->free_slots);
+  memset(pool, 0, sizeof(PiecePool));
+}
+
+// All slots are in use
+bool pool_exhausted(PiecePool *pool) {
+  return pool->n_free == 0 && pool->n_slots == pool->max_slots;
+}
+
+// NULL when all slots are in use
+uint8_t *pool_acquire(PiecePool *pool) {
+  if (pool->n_free > 0) return pool->free_slots[--pool->n_free];
+  if (pool->n_slots == pool->max_slots) return NULL;
+
+  uint8_t *slot = malloc(pool->slot_size);
+  if (slot == NULL) {
+    fprintf(stderr, "Out of memory. Couldn't allocate piece slot of %zu bytes\n", pool->slot_size);
+    exit(1);
+  }
+  pool->slots[pool->n_slots++] = slot;
+  if (DEBUG) printf("Allocated piece slot %d of %d\n", pool->n_slots, pool->max_slots);
+  return slot;
+}
+
+void pool_release(PiecePool *pool, uint8_t *slot) {
+  if (pool->n_free == pool->n_slots) {
+    fprintf(stderr, "[BUG] pool_release of more slots than were acquired\n");
+    exit(1);
+  }
+  pool->free_slots[pool->n_free++] = slot;
+}
@@ -26,39 +26,17 @@ void print_summary(Peer *peers, uint16_t n_peers, Torrent *t) {
   }
 
   {
-    int stages[PS_FLUSHED + 1] = {0};
+    // Kept up to date by set_piece_state, so the pieces aren't scanned
+    int *stages = t->piece_states;
     uint64_t sizes[PS_FLUSHED + 1] = {0};
-    float total_instantaneous_speed = 0.0;
-    float total_ma_speed = 0.0;
-
-    for (int i=0; i<t->n_pieces; i++) {
-      Piece *p = t->pieces + i;
-      stages[p->state]++;
-      if (p->state == PS_DOWNLOADING) {
-        sizes[PS_DOWNLOADED] += p->recieved_count * p->block_size;
-      } else {
-        sizes[p->state] += t->piece_length;
-      }
-
-
-      if (p->speed_timestamp_ms != 0) {
-        if (NOW_MS - p->speed_timestamp_ms > 500) {
-          float instantaneous_speed = ((float) p->speed_bytes_recieved) / (NOW_MS - p->speed_timestamp_ms) * 1000 / 1024; // KiB/s
-          if (p->speed_ma == -1) p->speed_ma = 0; // init
-          p->speed_ma = p->speed_ma * 0.9 + 0.1 * instantaneous_speed;
-          p->speed_bytes_recieved = 0;
-          p->speed_timestamp_ms = NOW_MS;
-          total_instantaneous_speed += instantaneous_speed;
-        } else {
-          total_instantaneous_speed += p->speed_ma;
-        }
-      }
-      total_ma_speed += p->speed_ma;
+    for (int s = PS_INIT; s <= PS_FLUSHED; s++) {
+      if (s != PS_DOWNLOADING) sizes[s] = stages[s] * t->piece_length;
     }
+    sizes[PS_DOWNLOADED] += t->downloading_blocks * PIECE_BLOCK_SIZE;
 
-    t->total_ma_speed_download = total_ma_speed;
-
-    fprintf(out, "Speed: %6.2f [%6.2f] KiB/s\n\n", total_ma_speed , total_instantaneous_speed);
+    uint64_t uploaded = 0;
+    for (int i = 0; i < n_peers; i++) uploaded += peers[i].uploaded_bytes;
+    fprintf(out, "Speed: %6.2f KiB/s; Uploaded: %7.2f MiB\n\n", t->total_ma_speed_download, uploaded / 1024.0 / 1024.0);
 
     fprintf(out, "Pieces\n");
     fprintf(out, "Init:   %5d; Downloading:  %5d; Downloaded:   %5d  Pieces\n",
@@ -76,11 +54,10 @@ void print_summary(Peer *peers, uint16_t n_peers, Torrent *t) {
     for (int i = 0; i < n_peers; i++) {
       Peer *p = peers + i;
       if (p->stage == S_ACTIVE) {
-        Piece *piece = p->piece;
-        fprintf(out, "Peer %3d (%3.0f%%): Piece %5d (%4d / %4d) @ %8.2f KiB/s Priority: %d Last Msg: %ld\n",
-                p->peer_idx, ((float)count_available_pieces(p, t->n_pieces)) / t->n_pieces * 100, piece->piece_idx,
-                piece->recieved_count,piece->total_blocks,
-                piece->speed_ma == -1 ? 0 : piece->speed_ma,
+        fprintf(out, "Peer %3d (%3.0f%%): %2d Pieces, %3d / %3d Requests, RTT %6.2f ms @ %8.2f KiB/s Priority: %d Last Msg: %ld\n",
+                p->peer_idx, ((float)p->n_available) / t->n_pieces * 100, p->n_pieces,
+                p->outstanding_requests, p->max_requests, p->rtt_ms,
+                p->speed_ma == -1 ? 0 : p->speed_ma,
                 p->priority,
                 NOW - p->last_msg_time);
       }
@@ -91,10 +68,9 @@ void print_summary(Peer *peers, uint16_t n_peers, Torrent *t) {
     for (int i = 0; i < n_peers; i++) {
       Peer *p = peers + i;
       if (p->stage == S_HANDSHAKED) {
-        int available_pieces =  count_available_pieces(p, t->n_pieces);
-        int interesting_pieces = count_interesting_pieces(t, p);
+        int available_pieces = p->n_available;
+        int interesting_pieces = p->n_interesting;
 
-        Piece *piece = p->piece;
         fprintf(out, "Peer %3d (%3.0f%%): Has %5d pieces, Interested in %5d pieces, %s, Priority: %d \n",
                 p->peer_idx, ((float)available_pieces / t->n_pieces * 100), available_pieces, interesting_pieces,
                 p->unchoked ? "Unchoked" : "Choked",
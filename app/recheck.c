@@ -0,0 +1,156 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "app.h"
+
+#define DEBUG false
+
+// Parallel recheck of data already on disk. A single file is mapped once, and
+// a pool of workers hashes its pieces straight from the page cache. Pieces of
+// a multi-file torrent can cross files, so there each worker reads them into
+// a buffer of its own instead of mapping every file. Workers
+// claim RECHECK_BATCH pieces at a time from a shared counter, so they stay
+// busy to the end however uneven the pieces are to read, and together walk
+// the file front to back.
+
+#define RECHECK_BATCH 4
+
+typedef struct Recheck {
+  Torrent *t;
+  uint8_t *data;
+  uint64_t data_size;
+  // Pieces to check, all when NULL
+  uint8_t *only;
+  uint8_t *result;
+  int bitmap_size;
+  uint32_t next_piece;
+  uint32_t checked;
+} Recheck;
+
+void *recheck_worker(void *arg) {
+  Recheck *r = arg;
+  Torrent *t = r->t;
+  uint8_t *buffer = r->data == NULL ? malloc(t->piece_length) : NULL;
+
+  while (true) {
+    uint32_t first = __atomic_fetch_add(&r->next_piece, RECHECK_BATCH, __ATOMIC_RELAXED);
+    if (first >= t->n_pieces) break;
+    uint32_t last = first + RECHECK_BATCH < t->n_pieces ? first + RECHECK_BATCH : t->n_pieces;
+
+    for (uint32_t piece_idx = first; piece_idx < last; piece_idx++) {
+      if (r->only != NULL && !aref_bit(r->only, r->bitmap_size, piece_idx)) continue;
+      uint64_t offset = piece_idx * t->piece_length;
+      uint64_t length = piece_size(t, piece_idx);
+      uint8_t *data;
+      if (r->data != NULL) {
+        if (offset + length > r->data_size) continue;
+        data = r->data + offset;
+      } else {
+        if (!storage_read(t->storage, buffer, length, offset)) continue;
+        data = buffer;
+      }
+
+      char actual_hash[20];
+      SHA1(actual_hash, (char *)data, length);
+      if (memcmp(actual_hash, t->pieces[piece_idx].hash.str, 20) == 0) {
+        // Neighbouring pieces share bytes of the bitmap
+        __atomic_fetch_or(r->result + piece_idx / 8, 0x80 >> (piece_idx % 8), __ATOMIC_RELAXED);
+      }
+      __atomic_fetch_add(&r->checked, 1, __ATOMIC_RELAXED);
+    }
+  }
+  free(buffer);
+  return NULL;
+}
+
+// At least one of the files can be opened. Missing files among several only
+// mean missing pieces
+bool recheck_readable(Storage *s) {
+  for (int i = 0; i < s->n_files; i++) {
+    if (storage_acquire(s, i) == -1) continue;
+    storage_release(s, i);
+    return true;
+  }
+  return false;
+}
+
+// Bitmap, in BITFIELD order, of the pieces whose data on disk matches their
+// hash. Only pieces set in only are checked, or all of them when it is NULL.
+// n_threads <= 0 uses one thread per online CPU. NULL when the files can't be
+// read at all
+uint8_t *recheck_pieces(Torrent *t, uint8_t *only, int n_threads) {
+  if (!recheck_readable(t->storage)) {
+    fprintf(stderr, "Couldn't open file to recheck: %d %s\n", errno, strerror(errno));
+    return NULL;
+  }
+  int bitmap_size = ceil_division(t->n_pieces, 8);
+  uint8_t *result = malloc(bitmap_size);
+  memset(result, 0, bitmap_size);
+
+  Recheck r = {.t = t, .only = only, .result = result, .bitmap_size = bitmap_size};
+  if (t->storage->n_files == 1) {
+    int fd = storage_acquire(t->storage, 0);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+      fprintf(stderr, "Couldn't open file to recheck: %d %s\n", errno, strerror(errno));
+      if (fd != -1) storage_release(t->storage, 0);
+      free(result);
+      return NULL;
+    }
+    if (st.st_size == 0) {
+      storage_release(t->storage, 0);
+      return result;
+    }
+    r.data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (r.data == MAP_FAILED) {
+      fprintf(stderr, "Couldn't map file to recheck: %d %s\n", errno, strerror(errno));
+      storage_release(t->storage, 0);
+      free(result);
+      return NULL;
+    }
+    r.data_size = st.st_size;
+    madvise(r.data, r.data_size, MADV_SEQUENTIAL);
+  }
+
+  if (n_threads <= 0) n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_threads > t->n_pieces) n_threads = t->n_pieces;
+  if (n_threads < 1) n_threads = 1;
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * n_threads);
+  int started = 0;
+  for (int i = 0; i < n_threads; i++) {
+    if (pthread_create(threads + i, NULL, recheck_worker, &r) != 0) break;
+    started++;
+  }
+  // Without any worker the calling thread does the work
+  if (started == 0) recheck_worker(&r);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  if (DEBUG) printf("Rechecked %d pieces with %d threads\n", r.checked, started);
+
+  free(threads);
+  if (r.data != NULL) {
+    munmap(r.data, r.data_size);
+    storage_release(t->storage, 0);
+  }
+  return result;
+}
+
+// Mark the pieces in bitmap as already on disk
+int apply_recheck(Torrent *t, uint8_t *bitmap) {
+  int bitmap_size = ceil_division(t->n_pieces, 8);
+  int restored = 0;
+  for (int i = 0; i < t->n_pieces; i++) {
+    if (!aref_bit(bitmap, bitmap_size, i) || t->pieces[i].state == PS_FLUSHED) continue;
+    t->pieces[i].state = PS_FLUSHED;
+    t->downloaded_pieces++;
+    restored++;
+  }
+  return restored;
+}
@@ -0,0 +1,236 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "app.h"
+
+#define DEBUG false
+
+// Fast-resume sidecar, kept next to the output. It records the pieces that
+// are on disk, and the recieved blocks of the pieces being downloaded. Those
+// blocks are written to their place in the output files when the sidecar is
+// saved on exit, and read back once their piece is picked again. The periodic
+// save from the network loop records finished pieces only, and stats the
+// output files on the disk thread, so it never waits on the disk.
+//
+// The total size and latest mtime of the output files are saved too. If they
+// still match on startup, the pieces are trusted as they are. Otherwise each
+// piece the sidecar claims is hashed again, and the partial pieces are dropped.
+//
+// Layout: ResumeHeader, piece bitmap, then n_partial times the piece index
+// followed by its block bitmap. Bitmaps are in BITFIELD order.
+
+#define RESUME_MAGIC "BTRESUM1"
+
+typedef struct ResumeHeader {
+  char magic[8];
+  uint8_t infohash[20];
+  uint32_t n_pieces;
+  uint64_t piece_length;
+  uint64_t file_length;
+  uint64_t file_size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint32_t n_partial;
+} ResumeHeader;
+
+int piece_block_count(Torrent *t, uint32_t piece_idx) {
+  return ceil_division(piece_size(t, piece_idx), PIECE_BLOCK_SIZE);
+}
+
+// Write the recieved blocks of a piece being downloaded to the output files
+bool write_partial_piece(Torrent *t, Piece *piece) {
+  for (uint32_t block_idx = 0; block_idx < piece->total_blocks; block_idx++) {
+    if (!bitset_get(piece->recieved_blocks, block_idx)) continue;
+    uint64_t begin = (uint64_t)block_idx * piece->block_size;
+    uint32_t length = block_idx == piece->total_blocks - 1 ? piece->last_block_size : piece->block_size;
+    if (!storage_write(t->storage, piece->buffer + begin, length, piece->piece_idx * t->piece_length + begin)) {
+      fprintf(stderr, "Couldn't save blocks of piece %d: %d %s\n", piece->piece_idx, errno, strerror(errno));
+      return false;
+    }
+  }
+  return true;
+}
+
+// Written to a temporary file first and renamed over the old sidecar, so a
+// crash while saving leaves the previous one intact. with_partial writes the
+// blocks of the pieces being downloaded out too. The size and mtime come from
+// stat when given, otherwise the files are stat'ed here
+void write_resume(Torrent *t, bool with_partial, DiskResult *stat) {
+  int bitmap_size = ceil_division(t->n_pieces, 8);
+  size_t max_size = sizeof(ResumeHeader) + bitmap_size;
+  for (int i = 0; i < t->n_pieces; i++) {
+    Piece *piece = t->pieces + i;
+    if (with_partial && piece->state == PS_DOWNLOADING && piece->recieved_count > 0) {
+      max_size += sizeof(uint32_t) + ceil_division(piece->total_blocks, 8);
+    }
+  }
+  uint8_t *buffer = malloc(max_size);
+  memset(buffer, 0, max_size);
+
+  ResumeHeader header = {.n_pieces = t->n_pieces, .piece_length = t->piece_length, .file_length = t->file_length};
+  memcpy(header.magic, RESUME_MAGIC, 8);
+  memcpy(header.infohash, t->infohash.str, 20);
+
+  uint8_t *bitmap = buffer + sizeof(ResumeHeader);
+  for (int i = 0; i < t->n_pieces; i++) {
+    if (t->pieces[i].state == PS_FLUSHED) setf_bit(bitmap, bitmap_size, i, 1);
+  }
+
+  uint8_t *p = bitmap + bitmap_size;
+  for (int i = 0; with_partial && i < t->n_pieces; i++) {
+    Piece *piece = t->pieces + i;
+    if (piece->state != PS_DOWNLOADING || piece->recieved_count == 0) continue;
+    if (!write_partial_piece(t, piece)) continue;
+
+    uint32_t piece_idx = piece->piece_idx;
+    memcpy(p, &piece_idx, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    int map_size = ceil_division(piece->total_blocks, 8);
+    for (uint32_t block_idx = 0; block_idx < piece->total_blocks; block_idx++) {
+      if (bitset_get(piece->recieved_blocks, block_idx)) setf_bit(p, map_size, block_idx, 1);
+    }
+    p += map_size;
+    header.n_partial++;
+  }
+
+  // After the partial blocks, so that their writes are covered
+  uint64_t size;
+  struct timespec mtime;
+  if (stat != NULL) {
+    size = stat->file_size;
+    mtime = stat->mtime;
+  } else {
+    storage_stat(t->storage, &size, &mtime);
+  }
+  header.file_size = size;
+  header.mtime_sec = mtime.tv_sec;
+  header.mtime_nsec = mtime.tv_nsec;
+  memcpy(buffer, &header, sizeof(ResumeHeader));
+
+  size_t tmp_path_size = strlen(t->resume_path) + 5;
+  char *tmp_path = malloc(tmp_path_size);
+  snprintf(tmp_path, tmp_path_size, "%s.tmp", t->resume_path);
+  FILE *file = fopen(tmp_path, "wb");
+  size_t length = p - buffer;
+  if (file == NULL || fwrite(buffer, length, 1, file) != 1 || fclose(file) != 0 || rename(tmp_path, t->resume_path) == -1) {
+    fprintf(stderr, "Couldn't save resume file %s: %d %s\n", t->resume_path, errno, strerror(errno));
+  } else if (DEBUG) {
+    printf("Saved resume file with %d partial pieces\n", header.n_partial);
+  }
+  free(tmp_path);
+  free(buffer);
+}
+
+void save_resume(Torrent *t, bool with_partial) {
+  if (t->resume_path == NULL || t->storage == NULL) return;
+  write_resume(t, with_partial, NULL);
+}
+
+// Periodic save from the network loop. The stat of the output files is queued
+// on the disk thread, and the sidecar is written by resume_stat_done. Returns
+// false when the disk queue is full, to try again later
+bool request_resume_save(Torrent *t) {
+  if (t->resume_path == NULL || t->storage == NULL || t->resume_stat_pending) return true;
+  if (disk_full(t->disk)) return false;
+  disk_submit(t->disk, (DiskJob){.stat = true, .storage = t->storage});
+  t->resume_stat_pending = true;
+  return true;
+}
+
+void resume_stat_done(Torrent *t, DiskResult *result) {
+  t->resume_stat_pending = false;
+  write_resume(t, false, result);
+}
+
+// Seed piece states from the sidecar. Returns the number of pieces restored,
+// -1 when there is no usable sidecar
+int load_resume(Torrent *t) {
+  if (t->resume_path == NULL || t->storage == NULL) return -1;
+  FILE *file = fopen(t->resume_path, "rb");
+  if (file == NULL) return -1;
+
+  fseek(file, 0, SEEK_END);
+  long length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t *buffer = malloc(length > 0 ? length : 1);
+  bool read_ok = length > 0 && fread(buffer, length, 1, file) == 1;
+  fclose(file);
+
+  ResumeHeader header;
+  int bitmap_size = ceil_division(t->n_pieces, 8);
+  if (!read_ok || length < sizeof(ResumeHeader) + bitmap_size) {
+    fprintf(stderr, "Ignoring truncated resume file %s\n", t->resume_path);
+    free(buffer);
+    return -1;
+  }
+  memcpy(&header, buffer, sizeof(ResumeHeader));
+  if (memcmp(header.magic, RESUME_MAGIC, 8) != 0 || memcmp(header.infohash, t->infohash.str, 20) != 0 ||
+      header.n_pieces != t->n_pieces || header.piece_length != t->piece_length || header.file_length != t->file_length) {
+    fprintf(stderr, "Ignoring resume file %s. It belongs to another torrent\n", t->resume_path);
+    free(buffer);
+    return -1;
+  }
+
+  uint64_t size;
+  struct timespec mtime;
+  storage_stat(t->storage, &size, &mtime);
+  bool trusted = size == header.file_size && mtime.tv_sec == header.mtime_sec && mtime.tv_nsec == header.mtime_nsec;
+  if (!trusted) printf("Output files changed since resume file was saved. Checking its pieces\n");
+
+  int restored;
+  uint8_t *bitmap = buffer + sizeof(ResumeHeader);
+  if (trusted) {
+    restored = apply_recheck(t, bitmap);
+  } else {
+    uint8_t *verified = recheck_pieces(t, bitmap, 0);
+    restored = verified == NULL ? 0 : apply_recheck(t, verified);
+    free(verified);
+  }
+
+  // Blocks of partial pieces can't be checked until the whole piece is there
+  uint8_t *p = bitmap + bitmap_size;
+  uint8_t *end = buffer + length;
+  for (uint32_t n = 0; trusted && n < header.n_partial; n++) {
+    uint32_t piece_idx;
+    if (end - p < sizeof(uint32_t)) break;
+    memcpy(&piece_idx, p, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    if (piece_idx >= t->n_pieces) break;
+    int map_size = ceil_division(piece_block_count(t, piece_idx), 8);
+    if (end - p < map_size) break;
+
+    Piece *piece = t->pieces + piece_idx;
+    if (piece->state == PS_INIT && piece->resume_blocks == NULL) {
+      piece->resume_blocks = malloc(map_size);
+      memcpy(piece->resume_blocks, p, map_size);
+    }
+    p += map_size;
+  }
+
+  printf("Resumed %d of %d pieces from %s\n", restored, t->n_pieces, t->resume_path);
+  free(buffer);
+  return restored;
+}
+
+// Piece was just activated. Take back the blocks an earlier run saved
+void restore_resume_blocks(Torrent *t, Piece *piece) {
+  if (piece->resume_blocks == NULL) return;
+
+  int map_size = ceil_division(piece->total_blocks, 8);
+  for (uint32_t block_idx = 0; block_idx < piece->total_blocks; block_idx++) {
+    // The last block stays unrecieved, so the piece still completes through
+    // the network loop
+    if (piece->recieved_count == piece->total_blocks - 1) break;
+    if (!aref_bit(piece->resume_blocks, map_size, block_idx)) continue;
+
+    uint64_t begin = (uint64_t)block_idx * piece->block_size;
+    uint32_t length = block_idx == piece->total_blocks - 1 ? piece->last_block_size : piece->block_size;
+    if (!storage_read(t->storage, piece->buffer + begin, length, piece->piece_idx * t->piece_length + begin)) break;
+    bitset_set(piece->recieved_blocks, block_idx);
+    piece->recieved_count++;
+  }
+  if (DEBUG) printf("Restored %d blocks of piece %d\n", piece->recieved_count, piece->piece_idx);
+  free(piece->resume_blocks);
+  piece->resume_blocks = NULL;
+}
@@ -19,42 +19,11 @@ A million repetitions of "a"
 #define SHA1HANDSOFF
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-/* for uint32_t */
-#include <stdint.h>
-
-typedef struct
-{
-    uint32_t state[5];
-    uint32_t count[2];
-    unsigned char buffer[64];
-} SHA1_CTX;
-
-void SHA1Transform(
-    uint32_t state[5],
-    const unsigned char buffer[64]
-    );
-
-void SHA1Init(
-    SHA1_CTX * context
-    );
-
-void SHA1Update(
-    SHA1_CTX * context,
-    const unsigned char *data,
-    uint32_t len
-    );
-
-void SHA1Final(
-    unsigned char digest[20],
-    SHA1_CTX * context
-    );
-
-void SHA1(
-    char *hash_out,
-    const char *str,
-    uint32_t len);
+#include "sha1.h"
 
 
 #define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
@@ -208,6 +177,276 @@ void SHA1Transform(
 }
 
 
+/* Hash `blocks` consecutive 512-bit blocks. Picked once at startup by
+ * SHA1SelectTransform() from the variants below. */
+
+typedef void (*SHA1TransformBlocksFn)(
+    uint32_t state[5],
+    const unsigned char *data,
+    size_t blocks
+    );
+
+static void SHA1TransformPortable(
+    uint32_t state[5],
+    const unsigned char *data,
+    size_t blocks
+)
+{
+    for (; blocks > 0; blocks--, data += 64)
+        SHA1Transform(state, data);
+}
+
+static SHA1TransformBlocksFn sha1_transform_blocks = SHA1TransformPortable;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define K1 0x5A827999
+#define K2 0x6ED9EBA1
+#define K3 0x8F1BBCDC
+#define K4 0xCA62C1D6
+
+/* Rounds over a precomputed schedule wk[i] = W[i] + K[i / 20] */
+#define WR1(v,w,x,y,z,i) z+=((w&(x^y))^y)+wk[i]+rol(v,5);w=rol(w,30);
+#define WR2(v,w,x,y,z,i) z+=(w^x^y)+wk[i]+rol(v,5);w=rol(w,30);
+#define WR3(v,w,x,y,z,i) z+=(((w|x)&y)|(w&x))+wk[i]+rol(v,5);w=rol(w,30);
+#define WR4(v,w,x,y,z,i) z+=(w^x^y)+wk[i]+rol(v,5);w=rol(w,30);
+
+#define WROUNDS5(R,i) \
+    R(a,b,c,d,e,i) R(e,a,b,c,d,i+1) R(d,e,a,b,c,i+2) R(c,d,e,a,b,i+3) R(b,c,d,e,a,i+4)
+
+static inline __attribute__((always_inline)) void SHA1RoundsWK(
+    uint32_t state[5],
+    const uint32_t wk[80]
+)
+{
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+    WROUNDS5(WR1, 0)  WROUNDS5(WR1, 5)  WROUNDS5(WR1, 10) WROUNDS5(WR1, 15)
+    WROUNDS5(WR2, 20) WROUNDS5(WR2, 25) WROUNDS5(WR2, 30) WROUNDS5(WR2, 35)
+    WROUNDS5(WR3, 40) WROUNDS5(WR3, 45) WROUNDS5(WR3, 50) WROUNDS5(WR3, 55)
+    WROUNDS5(WR4, 60) WROUNDS5(WR4, 65) WROUNDS5(WR4, 70) WROUNDS5(WR4, 75)
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+/* Four words of the message schedule at once:
+ * W[t..t+3] = rol1(W[t-3..t] ^ W[t-8..t-5] ^ W[t-14..t-11] ^ W[t-16..t-13])
+ * with m0..m3 = W[t-16..t-1]. W[t+3] depends on W[t] from the same group, so
+ * it is computed without it first and fixed up with rol2 of lane 0. */
+#define SCHEDULE(TYPE, XOR, SRLI, SLLI, ALIGNR, SLLW, SRLW, m0, m1, m2, m3, out) \
+    { \
+        TYPE x = XOR(XOR(SRLI(m3, 4), m2), XOR(ALIGNR(m1, m0, 8), m0)); \
+        TYPE fix = SLLI(x, 12); \
+        out = XOR(XOR(SLLW(x, 1), SRLW(x, 31)), XOR(SLLW(fix, 2), SRLW(fix, 30))); \
+    }
+
+__attribute__((target("ssse3")))
+static void SHA1TransformSSSE3(
+    uint32_t state[5],
+    const unsigned char *data,
+    size_t blocks
+)
+{
+    const __m128i BSWAP = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    const uint32_t K[4] = {K1, K2, K3, K4};
+    uint32_t wk[80] __attribute__((aligned(16)));
+
+    for (; blocks > 0; blocks--, data += 64)
+    {
+        __m128i w[20];
+        int i;
+
+        for (i = 0; i < 4; i++)
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), BSWAP);
+        for (i = 4; i < 20; i++)
+            SCHEDULE(__m128i, _mm_xor_si128, _mm_srli_si128, _mm_slli_si128, _mm_alignr_epi8,
+                     _mm_slli_epi32, _mm_srli_epi32, w[i - 4], w[i - 3], w[i - 2], w[i - 1], w[i]);
+        for (i = 0; i < 20; i++)
+            _mm_store_si128((__m128i *)(wk + 4 * i), _mm_add_epi32(w[i], _mm_set1_epi32(K[i / 5])));
+
+        SHA1RoundsWK(state, wk);
+    }
+}
+
+/* Same as SSSE3, but schedules two blocks at once: one per 128-bit lane */
+__attribute__((target("avx2")))
+static void SHA1TransformAVX2(
+    uint32_t state[5],
+    const unsigned char *data,
+    size_t blocks
+)
+{
+    const __m256i BSWAP = _mm256_set_epi8(
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    const uint32_t K[4] = {K1, K2, K3, K4};
+    uint32_t wk[2][80] __attribute__((aligned(32)));
+
+    for (; blocks >= 2; blocks -= 2, data += 128)
+    {
+        __m256i w[20];
+        int i;
+
+        for (i = 0; i < 4; i++)
+            w[i] = _mm256_shuffle_epi8(_mm256_loadu2_m128i((const __m128i *)(data + 64 + 16 * i),
+                                                           (const __m128i *)(data + 16 * i)), BSWAP);
+        for (i = 4; i < 20; i++)
+            SCHEDULE(__m256i, _mm256_xor_si256, _mm256_srli_si256, _mm256_slli_si256, _mm256_alignr_epi8,
+                     _mm256_slli_epi32, _mm256_srli_epi32, w[i - 4], w[i - 3], w[i - 2], w[i - 1], w[i]);
+        for (i = 0; i < 20; i++)
+        {
+            __m256i sum = _mm256_add_epi32(w[i], _mm256_set1_epi32(K[i / 5]));
+            _mm_store_si128((__m128i *)(wk[0] + 4 * i), _mm256_castsi256_si128(sum));
+            _mm_store_si128((__m128i *)(wk[1] + 4 * i), _mm256_extracti128_si256(sum, 1));
+        }
+
+        SHA1RoundsWK(state, wk[0]);
+        SHA1RoundsWK(state, wk[1]);
+    }
+    if (blocks > 0)
+        SHA1TransformSSSE3(state, data, blocks);
+}
+
+/* One step of 4 rounds with the SHA extensions. Step k uses message group
+ * m0 = W[4k..4k+3] and advances the schedule of the next three groups. */
+#define SHANI_STEP(e_cur, e_next, m0, m1, m2, m3, f, msg2, xor, msg1) \
+    e_cur = _mm_sha1nexte_epu32(e_cur, m0); \
+    e_next = abcd; \
+    if (msg2) m1 = _mm_sha1msg2_epu32(m1, m0); \
+    abcd = _mm_sha1rnds4_epu32(abcd, e_cur, f); \
+    if (msg1) m3 = _mm_sha1msg1_epu32(m3, m0); \
+    if (xor) m2 = _mm_xor_si128(m2, m0);
+
+__attribute__((target("sha,sse4.1")))
+static void SHA1TransformSHANI(
+    uint32_t state[5],
+    const unsigned char *data,
+    size_t blocks
+)
+{
+    const __m128i BSWAP = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd, e0, e1, abcd_save, e0_save;
+    __m128i m0, m1, m2, m3;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+    e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    for (; blocks > 0; blocks--, data += 64)
+    {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), BSWAP);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), BSWAP);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), BSWAP);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), BSWAP);
+
+        /* Rounds 0-3 */
+        e0 = _mm_add_epi32(e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        SHANI_STEP(e1, e0, m1, m2, m3, m0, 0, 0, 0, 1)   /* 4-7 */
+        SHANI_STEP(e0, e1, m2, m3, m0, m1, 0, 0, 1, 1)   /* 8-11 */
+        SHANI_STEP(e1, e0, m3, m0, m1, m2, 0, 1, 1, 1)   /* 12-15 */
+        SHANI_STEP(e0, e1, m0, m1, m2, m3, 0, 1, 1, 1)   /* 16-19 */
+        SHANI_STEP(e1, e0, m1, m2, m3, m0, 1, 1, 1, 1)   /* 20-23 */
+        SHANI_STEP(e0, e1, m2, m3, m0, m1, 1, 1, 1, 1)   /* 24-27 */
+        SHANI_STEP(e1, e0, m3, m0, m1, m2, 1, 1, 1, 1)   /* 28-31 */
+        SHANI_STEP(e0, e1, m0, m1, m2, m3, 1, 1, 1, 1)   /* 32-35 */
+        SHANI_STEP(e1, e0, m1, m2, m3, m0, 1, 1, 1, 1)   /* 36-39 */
+        SHANI_STEP(e0, e1, m2, m3, m0, m1, 2, 1, 1, 1)   /* 40-43 */
+        SHANI_STEP(e1, e0, m3, m0, m1, m2, 2, 1, 1, 1)   /* 44-47 */
+        SHANI_STEP(e0, e1, m0, m1, m2, m3, 2, 1, 1, 1)   /* 48-51 */
+        SHANI_STEP(e1, e0, m1, m2, m3, m0, 2, 1, 1, 1)   /* 52-55 */
+        SHANI_STEP(e0, e1, m2, m3, m0, m1, 2, 1, 1, 1)   /* 56-59 */
+        SHANI_STEP(e1, e0, m3, m0, m1, m2, 3, 1, 1, 1)   /* 60-63 */
+        SHANI_STEP(e0, e1, m0, m1, m2, m3, 3, 1, 1, 1)   /* 64-67 */
+        SHANI_STEP(e1, e0, m1, m2, m3, m0, 3, 1, 1, 0)   /* 68-71 */
+        SHANI_STEP(e0, e1, m2, m3, m0, m1, 3, 1, 0, 0)   /* 72-75 */
+        SHANI_STEP(e1, e0, m3, m0, m1, m2, 3, 0, 0, 0)   /* 76-79 */
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+/* Also used by bitfield.c to pick its kernels */
+int cpu_has_avx2(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+        return 0;
+    /* OS must save YMM state */
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6)
+        return 0;
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2);
+}
+
+static int cpu_has_shani(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+        return 0;
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA);
+}
+
+static int cpu_has_ssse3(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSSE3);
+}
+#endif
+
+typedef struct
+{
+    const char *name;
+    SHA1TransformBlocksFn fn;
+    int supported;
+} SHA1Variant;
+
+static SHA1Variant sha1_variants[4];
+static int n_sha1_variants = 0;
+
+/* Detect CPU features once at startup. Fastest supported variant goes first */
+__attribute__((constructor))
+static void SHA1SelectTransform(void)
+{
+    SHA1Variant *v = sha1_variants;
+
+#if defined(__x86_64__) || defined(__i386__)
+    *v++ = (SHA1Variant) { "sha-ni", SHA1TransformSHANI, cpu_has_shani() };
+    *v++ = (SHA1Variant) { "avx2", SHA1TransformAVX2, cpu_has_avx2() };
+    *v++ = (SHA1Variant) { "ssse3", SHA1TransformSSSE3, cpu_has_ssse3() };
+#endif
+    *v++ = (SHA1Variant) { "portable", SHA1TransformPortable, 1 };
+    n_sha1_variants = v - sha1_variants;
+
+    for (int i = 0; i < n_sha1_variants; i++)
+    {
+        if (sha1_variants[i].supported)
+        {
+            sha1_transform_blocks = sha1_variants[i].fn;
+            break;
+        }
+    }
+}
+
+
 /* SHA1Init - Initialize new context */
 
 void SHA1Init(
@@ -244,10 +483,12 @@ void SHA1Update(
     if ((j + len) > 63)
     {
         memcpy(&context->buffer[j], data, (i = 64 - j));
-        SHA1Transform(context->state, context->buffer);
-        for (; i + 63 < len; i += 64)
+        sha1_transform_blocks(context->state, context->buffer, 1);
+        if (i + 63 < len)
         {
-            SHA1Transform(context->state, &data[i]);
+            uint32_t blocks = (len - i) / 64;
+            sha1_transform_blocks(context->state, &data[i], blocks);
+            i += blocks * 64;
         }
         j = 0;
     }
@@ -316,10 +557,62 @@ void SHA1(
     uint32_t len)
 {
     SHA1_CTX ctx;
-    unsigned int ii;
 
     SHA1Init(&ctx);
-    for (ii=0; ii<len; ii+=1)
-        SHA1Update(&ctx, (const unsigned char*)str + ii, 1);
+    SHA1Update(&ctx, (const unsigned char*)str, len);
     SHA1Final((unsigned char *)hash_out, &ctx);
 }
+
+/* Hash `mib` MiB with every supported transform and report throughput */
+int SHA1Benchmark(
+    long mib)
+{
+    /* SHA1() takes a 32-bit length, so the buffer has to stay below 4 GiB */
+    if (mib <= 0 || mib >= 4096)
+    {
+        fprintf(stderr, "Buffer size must be between 1 and 4095 MiB\n");
+        return 1;
+    }
+    uint32_t len = (uint32_t) mib * 1024 * 1024;
+    char *data = malloc(len);
+    if (data == NULL)
+    {
+        fprintf(stderr, "Couldn't allocate %ld MiB\n", mib);
+        return 1;
+    }
+    char expected[20], hash[20];
+    SHA1TransformBlocksFn selected = sha1_transform_blocks;
+
+    for (uint32_t i = 0; i < len; i++)
+        data[i] = (char) (i * 2654435761u >> 24);
+
+    sha1_transform_blocks = SHA1TransformPortable;
+    SHA1(expected, data, len);
+
+    for (int v = 0; v < n_sha1_variants; v++)
+    {
+        SHA1Variant *variant = &sha1_variants[v];
+        if (!variant->supported)
+        {
+            printf("%-10s not supported by this CPU\n", variant->name);
+            continue;
+        }
+        sha1_transform_blocks = variant->fn;
+
+        struct timespec start, end;
+        int rounds = 4;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int r = 0; r < rounds; r++)
+            SHA1(hash, data, len);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%-10s %6.3f GB/s%s%s\n", variant->name, (double) len * rounds / secs / 1e9,
+               variant->fn == selected ? "  [selected]" : "",
+               memcmp(hash, expected, 20) == 0 ? "" : "  [WRONG DIGEST]");
+    }
+
+    sha1_transform_blocks = selected;
+    free(data);
+    return 0;
+}
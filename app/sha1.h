@@ -0,0 +1,47 @@
+#ifndef SHA1_H
+#define SHA1_H
+
+/* for uint32_t */
+#include <stdint.h>
+
+typedef struct
+{
+    uint32_t state[5];
+    uint32_t count[2];
+    unsigned char buffer[64];
+} SHA1_CTX;
+
+void SHA1Transform(
+    uint32_t state[5],
+    const unsigned char buffer[64]
+    );
+
+void SHA1Init(
+    SHA1_CTX * context
+    );
+
+void SHA1Update(
+    SHA1_CTX * context,
+    const unsigned char *data,
+    uint32_t len
+    );
+
+void SHA1Final(
+    unsigned char digest[20],
+    SHA1_CTX * context
+    );
+
+void SHA1(
+    char *hash_out,
+    const char *str,
+    uint32_t len);
+
+int SHA1Benchmark(
+    long mib);
+
+#if defined(__x86_64__) || defined(__i386__)
+/* CPU and OS support AVX2 */
+int cpu_has_avx2(void);
+#endif
+
+#endif
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "app.h"
+
+#define DEBUG false
+
+// Storage maps the torrent's byte range onto its files. A single-file torrent
+// is stored at the output path, a multi-file one in the directory named by it,
+// under the path each file has in the info dict.
+//
+// files[i].offset is where file i starts in the torrent, so the file holding
+// a byte is found by binary search. A piece that crosses files is written as
+// one span per file.
+//
+// Files are opened on first use and kept open, at most max_open of them. The
+// least recently used one is closed to make room, unless it is pinned by an
+// I/O still going on. Storage is shared by the network loop and the disk
+// thread, so the table is behind a mutex. The I/O itself runs outside of it.
+//
+// A single file can be mapped instead, see storage_map. Pieces are then
+// downloaded in place, and "writing" one only starts writeback of its pages.
+
+#define STORAGE_MAX_OPEN 128
+
+bool pread_all(int fd, uint8_t *buffer, uint64_t length, uint64_t offset) {
+  uint64_t done = 0;
+  while (done < length) {
+    ssize_t ret = pread(fd, buffer + done, length - done, offset + done);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret <= 0) return false;
+    done += ret;
+  }
+  return true;
+}
+
+bool pwrite_all(int fd, uint8_t *buffer, uint64_t length, uint64_t offset) {
+  uint64_t done = 0;
+  while (done < length) {
+    ssize_t ret = pwrite(fd, buffer + done, length - done, offset + done);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret <= 0) return false;
+    done += ret;
+  }
+  return true;
+}
+
+// A path component from the torrent must stay inside the output directory
+bool valid_path_component(String *component) {
+  if (component->length == 0) return false;
+  if (component->length == 1 && component->str[0] == '.') return false;
+  if (component->length == 2 && memcmp(component->str, "..", 2) == 0) return false;
+  return memchr(component->str, '/', component->length) == NULL && memchr(component->str, '\0', component->length) == NULL;
+}
+
+// root/component/... of one entry of info.files. NULL when it is unsafe
+char *storage_file_path(const char *root, LinkedList *components) {
+  size_t size = strlen(root) + 1;
+  for (LinkedList *c = components; c != NULL; c = c->next) {
+    if (!assert_type(c->val, TString, "File path component is not a String")) return NULL;
+    if (!valid_path_component(c->val->val.string)) return NULL;
+    size += 1 + c->val->val.string->length;
+  }
+  if (components == NULL) return NULL;
+
+  char *path = malloc(size);
+  char *p = path + sprintf(path, "%s", root);
+  for (LinkedList *c = components; c != NULL; c = c->next) {
+    String *component = c->val->val.string;
+    *p++ = '/';
+    memcpy(p, component->str, component->length);
+    p += component->length;
+  }
+  *p = '\0';
+  return path;
+}
+
+// Create the directories leading to path
+void make_parent_dirs(char *path) {
+  for (char *p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    mkdir(path, 0755);
+    *p = '/';
+  }
+}
+
+int storage_open(Storage *s, StorageFile *f) {
+  if (s->read_only) return open(f->path, O_RDONLY);
+  int fd = open(f->path, O_RDWR | O_CREAT, 0644);
+  if (fd == -1 && errno == ENOENT) {
+    make_parent_dirs(f->path);
+    fd = open(f->path, O_RDWR | O_CREAT, 0644);
+  }
+  return fd;
+}
+
+Storage *storage_create(Value *info, const char *path, bool read_only) {
+  Storage *s = malloc(sizeof(Storage));
+  memset(s, 0, sizeof(Storage));
+  s->read_only = read_only;
+  s->max_open = STORAGE_MAX_OPEN;
+  s->lru_head = s->lru_tail = -1;
+  pthread_mutex_init(&s->lock, NULL);
+
+  Value *length = gethash(info, "length");
+  if (length != NULL) {
+    s->n_files = 1;
+    s->files = malloc(sizeof(StorageFile));
+    s->files[0].path = strdup(path);
+    s->files[0].offset = 0;
+    s->files[0].length = length->val.integer;
+  } else {
+    LinkedList *files = gethash_safe(info, "files", TList)->val.list;
+    for (LinkedList *f = files; f != NULL; f = f->next) s->n_files++;
+    s->files = malloc(sizeof(StorageFile) * (s->n_files > 0 ? s->n_files : 1));
+
+    uint64_t offset = 0;
+    int i = 0;
+    for (LinkedList *f = files; f != NULL; f = f->next, i++) {
+      StorageFile *file = s->files + i;
+      file->fd = -1;
+      file->length = gethash_safe(f->val, "length", TInteger)->val.integer;
+      file->path = storage_file_path(path, gethash_safe(f->val, "path", TList)->val.list);
+      if (file->path == NULL) {
+        fprintf(stderr, "File %d of the torrent has an invalid path\n", i);
+        s->n_files = i;
+        storage_free(s);
+        return NULL;
+      }
+      file->offset = offset;
+      offset += file->length;
+    }
+  }
+
+  for (int i = 0; i < s->n_files; i++) {
+    s->files[i].fd = -1;
+    s->files[i].pins = 0;
+    s->files[i].lru_prev = s->files[i].lru_next = -1;
+  }
+
+  // No piece ever reaches an empty file
+  for (int i = 0; i < s->n_files && !read_only; i++) {
+    if (s->files[i].length > 0) continue;
+    int fd = storage_open(s, s->files + i);
+    if (fd != -1) close(fd);
+  }
+  if (s->n_files > 0) s->length = s->files[s->n_files - 1].offset + s->files[s->n_files - 1].length;
+  if (DEBUG) printf("Storage of %d files, %lu bytes\n", s->n_files, s->length);
+  return s;
+}
+
+void storage_free(Storage *s) {
+  if (s->map != NULL) munmap(s->map, s->length);
+  for (int i = 0; i < s->n_files; i++) {
+    if (s->files[i].fd != -1) close(s->files[i].fd);
+    free(s->files[i].path);
+  }
+  free(s->files);
+  pthread_mutex_destroy(&s->lock);
+  free(s);
+}
+
+// Index of the file holding the byte at offset. Empty files start where the
+// next file does, so they are never picked
+int storage_locate(Storage *s, uint64_t offset) {
+  int low = 0, high = s->n_files - 1;
+  while (low < high) {
+    int mid = low + (high - low + 1) / 2;
+    if (s->files[mid].offset <= offset) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return low;
+}
+
+void lru_unlink(Storage *s, int file_idx) {
+  StorageFile *f = s->files + file_idx;
+  if (f->lru_prev != -1) {
+    s->files[f->lru_prev].lru_next = f->lru_next;
+  } else {
+    s->lru_head = f->lru_next;
+  }
+  if (f->lru_next != -1) {
+    s->files[f->lru_next].lru_prev = f->lru_prev;
+  } else {
+    s->lru_tail = f->lru_prev;
+  }
+  f->lru_prev = f->lru_next = -1;
+}
+
+void lru_push_front(Storage *s, int file_idx) {
+  StorageFile *f = s->files + file_idx;
+  f->lru_prev = -1;
+  f->lru_next = s->lru_head;
+  if (s->lru_head != -1) s->files[s->lru_head].lru_prev = file_idx;
+  s->lru_head = file_idx;
+  if (s->lru_tail == -1) s->lru_tail = file_idx;
+}
+
+// Close least recently used files until there is room for one more. Pinned
+// files are skipped, so with all of them pinned the limit is exceeded for a
+// while
+void storage_evict(Storage *s) {
+  int file_idx = s->lru_tail;
+  while (s->n_open >= s->max_open && file_idx != -1) {
+    StorageFile *f = s->files + file_idx;
+    int prev = f->lru_prev;
+    if (f->pins == 0) {
+      if (DEBUG) printf("Closing %s\n", f->path);
+      lru_unlink(s, file_idx);
+      close(f->fd);
+      f->fd = -1;
+      s->n_open--;
+    }
+    file_idx = prev;
+  }
+}
+
+// fd of a file, opened if needed. The file stays open until it is released.
+// -1 with errno set when it can't be opened
+int storage_acquire(Storage *s, int file_idx) {
+  pthread_mutex_lock(&s->lock);
+  StorageFile *f = s->files + file_idx;
+  if (f->fd == -1) {
+    storage_evict(s);
+    int fd = storage_open(s, f);
+    if (fd == -1) {
+      int error = errno;
+      pthread_mutex_unlock(&s->lock);
+      errno = error;
+      return -1;
+    }
+    f->fd = fd;
+    s->n_open++;
+  } else {
+    lru_unlink(s, file_idx);
+  }
+  lru_push_front(s, file_idx);
+  f->pins++;
+  int fd = f->fd;
+  pthread_mutex_unlock(&s->lock);
+  return fd;
+}
+
+void storage_release(Storage *s, int file_idx) {
+  pthread_mutex_lock(&s->lock);
+  if (s->files[file_idx].pins == 0) {
+    fprintf(stderr, "[BUG] storage_release of file %d that isn't acquired\n", file_idx);
+    exit(1);
+  }
+  s->files[file_idx].pins--;
+  pthread_mutex_unlock(&s->lock);
+}
+
+// Acquire the file holding offset. span tells where in it the range starting
+// at offset goes, and how much of length fits before the file ends
+bool storage_acquire_span(Storage *s, uint64_t offset, uint64_t length, StorageSpan *span) {
+  span->file_idx = storage_locate(s, offset);
+  StorageFile *f = s->files + span->file_idx;
+  span->file_offset = offset - f->offset;
+  span->length = f->length - span->file_offset;
+  if (span->length > length) span->length = length;
+  span->fd = storage_acquire(s, span->file_idx);
+  return span->fd != -1;
+}
+
+// Allocate the whole output file and map it, so blocks are recieved straight
+// into their place in it. Only single-file torrents can be mapped. False
+// when the file can't be, and it is used through pread/pwrite as before.
+// The file stays acquired while mapped
+bool storage_map(Storage *s) {
+  if (s->n_files != 1 || s->read_only || s->length == 0) return false;
+  int fd = storage_acquire(s, 0);
+  if (fd == -1) return false;
+
+  // Writing to a page of a sparse file could fail with SIGBUS when the disk
+  // fills up. Reserve the blocks now, where the failure can be reported
+  int ret = fallocate(fd, 0, 0, s->length);
+  if (ret == -1 && errno == EOPNOTSUPP) ret = ftruncate(fd, s->length);
+  if (ret == -1) {
+    fprintf(stderr, "Couldn't allocate %s: %d %s\n", s->files[0].path, errno, strerror(errno));
+    storage_release(s, 0);
+    return false;
+  }
+
+  uint8_t *map = mmap(NULL, s->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Couldn't map %s: %d %s\n", s->files[0].path, errno, strerror(errno));
+    storage_release(s, 0);
+    return false;
+  }
+  s->map = map;
+  return true;
+}
+
+// Data in [offset, offset + length) of the mapping is final. Start writing it
+// back, and drop the pages from our address space. They stay in the page
+// cache, where sendfile finds them for uploads
+void storage_flush_mapped(Storage *s, uint64_t offset, uint64_t length) {
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  uint64_t start = offset / page_size * page_size;
+  length += offset - start;
+  sync_file_range(s->files[0].fd, start, length, SYNC_FILE_RANGE_WRITE);
+  madvise(s->map + start, length, MADV_DONTNEED);
+}
+
+// Bytes [offset, offset + length) of the torrent. False on errors and when a
+// file is too short
+bool storage_read(Storage *s, uint8_t *buffer, uint64_t length, uint64_t offset) {
+  if (s->map != NULL) {
+    if (offset + length > s->length) return false;
+    if (buffer != s->map + offset) memcpy(buffer, s->map + offset, length);
+    return true;
+  }
+  while (length > 0) {
+    StorageSpan span;
+    if (!storage_acquire_span(s, offset, length, &span)) return false;
+    bool ok = span.length > 0 && pread_all(span.fd, buffer, span.length, span.file_offset);
+    storage_release(s, span.file_idx);
+    if (!ok) return false;
+    buffer += span.length;
+    offset += span.length;
+    length -= span.length;
+  }
+  return true;
+}
+
+// Pieces recieved into the mapping are already in place
+bool storage_write(Storage *s, uint8_t *buffer, uint64_t length, uint64_t offset) {
+  if (s->map != NULL) {
+    if (offset + length > s->length) return false;
+    if (buffer != s->map + offset) memcpy(s->map + offset, buffer, length);
+    storage_flush_mapped(s, offset, length);
+    return true;
+  }
+  while (length > 0) {
+    StorageSpan span;
+    if (!storage_acquire_span(s, offset, length, &span)) return false;
+    bool ok = span.length > 0 && pwrite_all(span.fd, buffer, span.length, span.file_offset);
+    storage_release(s, span.file_idx);
+    if (!ok) return false;
+    buffer += span.length;
+    offset += span.length;
+    length -= span.length;
+  }
+  return true;
+}
+
+// Total size of the files on disk and the latest mtime among them. Missing
+// files count as empty
+void storage_stat(Storage *s, uint64_t *size, struct timespec *mtime) {
+  *size = 0;
+  mtime->tv_sec = 0;
+  mtime->tv_nsec = 0;
+  for (int i = 0; i < s->n_files; i++) {
+    struct stat st;
+    if (stat(s->files[i].path, &st) == -1) continue;
+    *size += st.st_size;
+    if (st.st_mtim.tv_sec > mtime->tv_sec ||
+        (st.st_mtim.tv_sec == mtime->tv_sec && st.st_mtim.tv_nsec > mtime->tv_nsec)) {
+      *mtime = st.st_mtim;
+    }
+  }
+}
+
+// Empty the files that exist, to start the download over
+void storage_truncate(Storage *s) {
+  for (int i = 0; i < s->n_files; i++) {
+    if (truncate(s->files[i].path, 0) == -1 && errno != ENOENT) {
+      fprintf(stderr, "Couldn't truncate %s: %d %s\n", s->files[i].path, errno, strerror(errno));
+    }
+  }
+}
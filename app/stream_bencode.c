@@ -0,0 +1,209 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "app.h"
+
+// Incremental bencode parser. Input is fed in chunks of any size, e.g. as
+// curl hands them over, and the Value tree is built in the parser's arena as
+// values complete. Nothing is read past the end of a chunk: a value cut in
+// the middle is resumed by the next feed. Malformed input is reported through
+// the return value instead of exiting.
+//
+// Strings are copied, since chunks don't outlive the feed call, so entries
+// have no raw span.
+
+void bencode_parser_init(BencodeParser *p, Arena *arena) {
+  memset(p, 0, sizeof(BencodeParser));
+  p->arena = arena;
+}
+
+// Scratch entries of dicts still open. The tree itself is in the arena
+void bencode_parser_free(BencodeParser *p) {
+  for (int i = 0; i < p->depth; i++) {
+    free(p->frames[i].entries);
+    p->frames[i].entries = NULL;
+  }
+}
+
+BencodeStatus bencode_fail(BencodeParser *p, const char *error) {
+  p->error = error;
+  return BENCODE_ERROR;
+}
+
+// Place a complete value in the innermost open container, or make it the root
+BencodeStatus bencode_emit(BencodeParser *p, Value *val) {
+  if (p->depth == 0) {
+    p->root = val;
+    return BENCODE_NEED_MORE;
+  }
+
+  BencodeFrame *frame = p->frames + p->depth - 1;
+  if (frame->value->type == TList) {
+    LinkedList *cell = arena_alloc(p->arena, sizeof(LinkedList));
+    cell->val = val;
+    cell->next = NULL;
+    if (frame->tail == NULL) {
+      frame->head = cell;
+    } else {
+      frame->tail->next = cell;
+    }
+    frame->tail = cell;
+    return BENCODE_NEED_MORE;
+  }
+
+  if (frame->length == frame->capacity) {
+    frame->capacity = frame->capacity == 0 ? 16 : frame->capacity * 2;
+    frame->entries = realloc(frame->entries, sizeof(KeyVal) * frame->capacity);
+  }
+  KeyVal *kv = frame->entries + frame->length;
+  kv->key = frame->key;
+  kv->val = val;
+  kv->raw.str = NULL;
+  kv->raw.length = 0;
+  if (frame->length > 0 && compare_key(kv[-1].key, kv->key->str, kv->key->length) >= 0) frame->sorted = false;
+  frame->length++;
+  frame->key = NULL;
+  return BENCODE_NEED_MORE;
+}
+
+// A string is complete. It is either a dict key or a value
+BencodeStatus bencode_emit_string(BencodeParser *p) {
+  String *string = p->string;
+  p->string = NULL;
+  p->token = BT_NONE;
+
+  BencodeFrame *frame = p->depth == 0 ? NULL : p->frames + p->depth - 1;
+  if (frame != NULL && frame->value->type == TDict && frame->key == NULL) {
+    frame->key = string;
+    return BENCODE_NEED_MORE;
+  }
+  Value *val = arena_alloc(p->arena, sizeof(Value));
+  val->type = TString;
+  val->val.string = string;
+  return bencode_emit(p, val);
+}
+
+BencodeStatus bencode_open(BencodeParser *p, enum Type type) {
+  if (p->depth == BENCODE_MAX_DEPTH) return bencode_fail(p, "Nesting is too deep");
+  Value *val = arena_alloc(p->arena, sizeof(Value));
+  val->type = type;
+  BencodeFrame *frame = p->frames + p->depth++;
+  memset(frame, 0, sizeof(BencodeFrame));
+  frame->value = val;
+  frame->sorted = true;
+  return BENCODE_NEED_MORE;
+}
+
+BencodeStatus bencode_close(BencodeParser *p) {
+  if (p->depth == 0) return bencode_fail(p, "Unexpected 'e'");
+  BencodeFrame *frame = p->frames + p->depth - 1;
+  Value *val = frame->value;
+
+  if (val->type == TList) {
+    val->val.list = frame->head;
+  } else {
+    if (frame->key != NULL) return bencode_fail(p, "Dict key without a value");
+    Dict *dict = arena_alloc(p->arena, sizeof(Dict) + sizeof(KeyVal) * frame->length);
+    dict->length = frame->length;
+    dict->sorted = frame->sorted;
+    if (frame->length > 0) memcpy(dict->entries, frame->entries, sizeof(KeyVal) * frame->length);
+    free(frame->entries);
+    frame->entries = NULL;
+    val->val.dict = dict;
+  }
+  p->depth--;
+  return bencode_emit(p, val);
+}
+
+bool bencode_is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+// Feed the next len bytes. BENCODE_DONE once the top level value is complete,
+// and the tree is in p->root. Bytes past it are an error
+BencodeStatus bencode_parser_feed(BencodeParser *p, const char *data, size_t len) {
+  if (p->error != NULL) return BENCODE_ERROR;
+
+  size_t i = 0;
+  while (i < len) {
+    if (p->root != NULL) return bencode_fail(p, "Trailing data after value");
+    BencodeStatus status = BENCODE_NEED_MORE;
+    char c = data[i];
+
+    if (p->token == BT_STRING) {
+      size_t n = p->string->length - p->string_done;
+      if (n > len - i) n = len - i;
+      memcpy(p->string->str + p->string_done, data + i, n);
+      p->string_done += n;
+      i += n;
+      if (p->string_done == p->string->length) status = bencode_emit_string(p);
+
+    } else if (p->token == BT_LENGTH) {
+      i++;
+      if (bencode_is_digit(c)) {
+        p->integer = p->integer * 10 + (c - '0');
+        if (p->integer > BENCODE_MAX_STRING) return bencode_fail(p, "String is too long");
+      } else if (c == ':') {
+        String *string = arena_alloc(p->arena, sizeof(String));
+        string->length = p->integer;
+        string->str = arena_alloc(p->arena, string->length + 1);
+        string->str[string->length] = '\0';
+        p->string = string;
+        p->string_done = 0;
+        p->token = BT_STRING;
+        if (string->length == 0) status = bencode_emit_string(p);
+      } else {
+        return bencode_fail(p, "Invalid string length");
+      }
+
+    } else if (p->token == BT_INTEGER) {
+      i++;
+      if (c == 'e') {
+        if (p->digits == 0) return bencode_fail(p, "Integer without digits");
+        if (p->negative && p->integer == 0) return bencode_fail(p, "Negative zero");
+        Value *val = arena_alloc(p->arena, sizeof(Value));
+        val->type = TInteger;
+        val->val.integer = p->negative ? -p->integer : p->integer;
+        p->token = BT_NONE;
+        status = bencode_emit(p, val);
+      } else if (c == '-' && p->digits == 0 && !p->negative) {
+        p->negative = true;
+      } else if (bencode_is_digit(c)) {
+        if (p->digits > 0 && p->integer == 0) return bencode_fail(p, "Integer with a leading zero");
+        if (p->integer > (INT64_MAX - (c - '0')) / 10) return bencode_fail(p, "Integer overflows");
+        p->integer = p->integer * 10 + (c - '0');
+        p->digits++;
+      } else {
+        return bencode_fail(p, "Invalid integer");
+      }
+
+    } else {
+      // Start of a value, or the end of a container
+      i++;
+      BencodeFrame *frame = p->depth == 0 ? NULL : p->frames + p->depth - 1;
+      bool want_key = frame != NULL && frame->value->type == TDict && frame->key == NULL;
+      if (c == 'e') {
+        status = bencode_close(p);
+      } else if (bencode_is_digit(c)) {
+        p->token = BT_LENGTH;
+        p->integer = c - '0';
+      } else if (want_key) {
+        return bencode_fail(p, "Dict key is not a string");
+      } else if (c == 'i') {
+        p->token = BT_INTEGER;
+        p->integer = 0;
+        p->digits = 0;
+        p->negative = false;
+      } else if (c == 'l') {
+        status = bencode_open(p, TList);
+      } else if (c == 'd') {
+        status = bencode_open(p, TDict);
+      } else {
+        return bencode_fail(p, "Unexpected byte");
+      }
+    }
+    if (status == BENCODE_ERROR) return status;
+  }
+  return p->root != NULL ? BENCODE_DONE : BENCODE_NEED_MORE;
+}
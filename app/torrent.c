@@ -8,6 +8,8 @@
 #include <curl/curl.h>
 #include <string.h>
 #include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
@@ -17,8 +19,16 @@
 #define DEBUG false
 #define DEBUG_MSGTYPE false
 
+// Bounds of a peer's request queue, in blocks
+#define MIN_REQUESTS 10
+#define MAX_REQUESTS 256
+
+// Seconds between saves of the fast-resume file
+#define RESUME_INTERVAL 60
+
 time_t NOW = 0;
 float NOW_MS = 0.0f;
+volatile sig_atomic_t STOP_REQUESTED = 0;
 
 bool connect_peer(Peer *p, struct sockaddr_in addr) {
   if (DEBUG) {
@@ -51,20 +61,57 @@ bool connect_peer(Peer *p, struct sockaddr_in addr) {
 }
 
 bool process_handshake(Peer *p) {
-  if (p->recv_bytes < 68) {
+  if (p->recv_bytes - p->processed_bytes < 68) {
     fprintf(stderr, "Recieved input is invalid for handshake\n");
     p->stage = S_ERROR;
     close(p->sock);
     return false;
   }
 
-  memcpy(p->peer_id, p->recvbuffer + 1 + 19 + 8 + 20, 20);
-  p->processed_bytes += 68;
+  memcpy(p->peer_id, recvbuffer_head(p) + 1 + 19 + 8 + 20, 20);
+  consume_recvbuffer(p, 68);
   if (DEBUG) printf("Handshake complete\n");
   p->stage = S_HANDSHAKED;
   return true;
 }
 
+// First block at or after from that hasn't been recieved, total_blocks when
+// there is none
+uint32_t first_missing_block(Piece *piece, uint32_t from) {
+  for (uint32_t word = from / 64; word < piece->block_words; word++) {
+    uint64_t missing = ~piece->recieved_blocks[word];
+    if (word == from / 64) missing &= ~0ULL << (from % 64);
+    if (missing != 0) {
+      uint32_t block_idx = word * 64 + __builtin_ctzll(missing);
+      return block_idx < piece->total_blocks ? block_idx : piece->total_blocks;
+    }
+  }
+  return piece->total_blocks;
+}
+
+// Feed the blocks that are now contiguous with the hashed prefix into the
+// piece's running hash
+void hash_piece_blocks(Piece *piece) {
+  uint32_t from = piece->hashed_blocks;
+  piece->hashed_blocks = first_missing_block(piece, from);
+  if (piece->hashed_blocks == from) return;
+
+  uint64_t begin = (uint64_t)from * piece->block_size;
+  uint64_t end = piece->hashed_blocks == piece->total_blocks ? piece->piece_length : (uint64_t)piece->hashed_blocks * piece->block_size;
+  SHA1Update(&piece->sha_ctx, piece->buffer + begin, end - begin);
+}
+
+// Block maps of a piece sit after its buffer in a pool slot: the two bitsets,
+// then asked_blocks. Placed at a word boundary
+size_t piece_maps_offset(uint64_t piece_length) {
+  return (piece_length + 7) & ~(uint64_t)7;
+}
+
+size_t piece_maps_size(uint64_t piece_length) {
+  uint32_t total_blocks = ceil_division(piece_length, PIECE_BLOCK_SIZE);
+  return 2 * sizeof(uint64_t) * ceil_division(total_blocks, 64) + total_blocks;
+}
+
 // Initialize piece for download
 bool initalize_piece_for_download(Torrent *t, Peer *p, Piece *piece) {
 
@@ -80,41 +127,53 @@ bool initalize_piece_for_download(Torrent *t, Peer *p, Piece *piece) {
   if (piece_idx == total_pieces - 1) // last piece may be smaller
     piece_length = file_length - piece_idx * piece_length;
 
-  uint32_t BLOCK_SIZE = 16 * 1024; // 16 kiB
-  uint32_t total_blocks = ceil_division(piece_length, BLOCK_SIZE);
-  uint32_t last_block_size = piece_length - (total_blocks - 1) * BLOCK_SIZE;
-  if (last_block_size == 0) last_block_size = BLOCK_SIZE;
+  uint32_t total_blocks = ceil_division(piece_length, PIECE_BLOCK_SIZE);
+  uint32_t last_block_size = piece_length - (total_blocks - 1) * PIECE_BLOCK_SIZE;
+  if (last_block_size == 0) last_block_size = PIECE_BLOCK_SIZE;
 
   piece->piece_length = piece_length;
-  piece->block_size = BLOCK_SIZE;
+  piece->block_size = PIECE_BLOCK_SIZE;
+  piece->block_words = ceil_division(total_blocks, 64);
   piece->total_blocks = total_blocks;
   piece->last_block_size = last_block_size;
 
-  // Allocate memory
-  uint8_t *buffer = malloc(piece_length);
-  uint8_t *asked_blocks = malloc(total_blocks);
-  uint8_t *recieved_blocks = malloc(total_blocks);
-  memset(recieved_blocks, 0, total_blocks);
-  memset(asked_blocks, 0, total_blocks);
+  // Buffer and block maps come from a pool slot. A mapped output file is
+  // recieved into directly, and only the maps are in the slot
+  uint8_t *slot = pool_acquire(&t->pool);
+  if (slot == NULL) {
+    fprintf(stderr, "[BUG] Activating piece %d without a free slot\n", piece_idx);
+    exit(1);
+  }
+  piece->slot = slot;
+  piece->mapped = t->storage != NULL && t->storage->map != NULL;
+  uint8_t *buffer = piece->mapped ? t->storage->map + piece_idx * t->piece_length : slot;
+  uint8_t *maps = piece->mapped ? slot : slot + piece_maps_offset(t->piece_length);
+  memset(maps, 0, piece_maps_size(piece_length));
 
   piece->buffer = buffer;
-  piece->asked_blocks = asked_blocks;
-  piece->recieved_blocks = recieved_blocks;
+  piece->recieved_blocks = (uint64_t *)maps;
+  piece->requested_blocks = piece->recieved_blocks + piece->block_words;
+  piece->asked_blocks = (uint8_t *)(piece->requested_blocks + piece->block_words);
   piece->recieved_count = 0;
   piece->outstanding_requests_count = 0;
-
-  // Reset stats for speed
-  piece->speed_bytes_recieved = 0;
-  piece->speed_timestamp_ms = NOW_MS;
-  piece->speed_ma = -1;
+  piece->flushed_bytes = 0;
+  SHA1Init(&piece->sha_ctx);
+  piece->hashed_blocks = 0;
+  restore_resume_blocks(t, piece);
+  hash_piece_blocks(piece);
 
   printf("Downloading piece %d of size %llu in %d blocks \n", piece_idx, piece_length, total_blocks);
   return true;
 }
 
+// Only the blocks not already fed by hash_piece_blocks are hashed here
 bool verify_piece(Piece *piece) {
   char actual_hash[20];
-  SHA1(actual_hash, (void *)piece->buffer, piece->piece_length);
+  uint64_t hashed_bytes = (uint64_t)piece->hashed_blocks * piece->block_size;
+  if (hashed_bytes < piece->piece_length) {
+    SHA1Update(&piece->sha_ctx, piece->buffer + hashed_bytes, piece->piece_length - hashed_bytes);
+  }
+  SHA1Final((unsigned char *)actual_hash, &piece->sha_ctx);
 
   if (memcmp(actual_hash, piece->hash.str, 20) != 0) {
     printf("[BAD] Got Hash for piece %d: ", piece->piece_idx);
@@ -131,67 +190,217 @@ bool verify_piece(Piece *piece) {
   }
 }
 
-void cleanup_piece_after_download(Piece *piece) {
-  free(piece->asked_blocks);
-  free(piece->recieved_blocks);
-  free(piece->buffer);
+// Keep t->wanted, and the interesting counts of the peers that have the
+// piece, in step with a piece entering or leaving PS_INIT
+void set_piece_state(Torrent *t, Piece *piece, enum PIECE_STATE state) {
+  if ((piece->state == PS_INIT) != (state == PS_INIT)) {
+    bool wanted = state == PS_INIT;
+    setf_bit(t->wanted, ceil_division(t->n_pieces, 8), piece->piece_idx, wanted);
+    if (wanted) {
+      picker_add(&t->picker, piece->piece_idx);
+    } else {
+      picker_remove(&t->picker, piece->piece_idx);
+    }
+    for (int i = 0; i < t->n_peers; i++) {
+      Peer *peer = t->peers + i;
+      if (aref_bit(peer->bitmap, peer->bitmap_size, piece->piece_idx)) peer->n_interesting += wanted ? 1 : -1;
+    }
+  }
+  if (piece->state == PS_DOWNLOADING && state != PS_DOWNLOADING) {
+    t->downloading_blocks -= piece->recieved_count;
+    // Last piece takes its place
+    Piece *last = t->downloading[--t->n_downloading];
+    t->downloading[piece->downloading_pos] = last;
+    last->downloading_pos = piece->downloading_pos;
+  }
+  if (state == PS_DOWNLOADING && piece->state != PS_DOWNLOADING) {
+    t->downloading_blocks += piece->recieved_count;
+    if (t->n_downloading == t->pool.max_slots) {
+      fprintf(stderr, "[BUG] more pieces downloading than there are slots\n");
+      exit(1);
+    }
+    piece->downloading_pos = t->n_downloading;
+    t->downloading[t->n_downloading++] = piece;
+  }
+  t->piece_states[piece->state]--;
+  t->piece_states[state]++;
+  piece->state = state;
+}
+
+void cleanup_piece_after_download(Torrent *t, Piece *piece) {
+  pool_release(&t->pool, piece->slot);
+  piece->slot = NULL;
+}
+
+// Piece is on disk, so it can be uploaded. Tell the peers that don't have it
+void piece_flushed(Torrent *t, Piece *piece) {
+  printf("Piece %d saved to disk\n", piece->piece_idx);
+  t->write_failures = 0;
+  cleanup_piece_after_download(t, piece);
+  set_piece_state(t, piece, PS_FLUSHED);
+
+  for (int i = 0; i < t->n_peers; i++) {
+    Peer *peer = t->peers + i;
+    if ((peer->stage == S_HANDSHAKED || peer->stage == S_ACTIVE) &&
+        !aref_bit(peer->bitmap, peer->bitmap_size, piece->piece_idx)) {
+      send_have(peer, piece->piece_idx);
+    }
+  }
+}
+
+// Piece couldn't be written out. Drop it and download it again, unless
+// writes keep failing
+void piece_write_failed(Torrent *t, Piece *piece) {
+  if (++t->write_failures >= MAX_WRITE_FAILURES) {
+    if (!t->disk_failed) fprintf(stderr, "%d writes failed in a row. Giving up\n", t->write_failures);
+    t->disk_failed = true;
+  } else {
+    fprintf(stderr, "Piece %d will be downloaded again\n", piece->piece_idx);
+  }
+  t->downloaded_pieces--;
+  set_piece_state(t, piece, PS_INIT);
+  cleanup_piece_after_download(t, piece);
+}
+
+uint64_t piece_size(Torrent *t, uint32_t piece_idx) {
+  if (piece_idx == t->n_pieces - 1) return t->file_length - (uint64_t)piece_idx * t->piece_length;
+  return t->piece_length;
+}
+
+// Hand a fully downloaded piece to the disk stage, which hashes it and writes
+// it out. Waits for the disk stage to catch up when too many pieces are queued.
+void submit_piece_to_disk(Torrent *t, Piece *piece) {
+  while (disk_full(t->disk)) {
+    disk_wait_completion(t->disk);
+    process_disk_completions(t);
+  }
+
+  DiskJob job = {.piece = piece};
+  // With io_uring the write goes through the ring instead. Mapped pieces
+  // are already in place, and only need their writeback started
+  if (t->storage != NULL && (t->ring == NULL || t->storage->map != NULL)) {
+    job.storage = t->storage;
+    job.offset = piece->piece_idx * t->piece_length;
+  }
+  disk_submit(t->disk, job);
+}
+
+void process_disk_completions(Torrent *t) {
+  DiskResult result;
+  while (disk_pop_completion(t->disk, &result)) {
+    if (result.stat) {
+      resume_stat_done(t, &result);
+      continue;
+    }
+    Piece *piece = result.piece;
+    if (!result.verified) {
+      // Download it again
+      set_piece_state(t, piece, PS_INIT);
+      cleanup_piece_after_download(t, piece);
+      continue;
+    }
+
+    set_piece_state(t, piece, PS_DOWNLOADED);
+    t->downloaded_pieces++;
+    if (result.flushed) {
+      piece_flushed(t, piece);
+    } else if (result.write_failed) {
+      piece_write_failed(t, piece);
+    } else if (t->ring != NULL && t->storage != NULL) {
+      uring_write_piece(t->ring, t, piece);
+    }
+    // and send a HAVE to all active peers
+  }
+}
+
+uint32_t block_length(Piece *piece, uint32_t block_idx) {
+  return block_idx == piece->total_blocks - 1 ? piece->last_block_size : piece->block_size;
 }
 
+// Slot of peer in piece->peers, -1 if it isn't downloading the piece
+int piece_peer_slot(Piece *piece, Peer *peer) {
+  for (int slot = 0; slot < MAX_PIECE_PEERS; slot++) {
+    if (piece->peers[slot] == peer) return slot;
+  }
+  return -1;
+}
+
+void add_piece_peer(Piece *piece, Peer *peer) {
+  int slot = piece_peer_slot(piece, NULL);
+  if (slot == -1) {
+    fprintf(stderr, "[BUG] piece %d has no free peer slot\n", piece->piece_idx);
+    exit(1);
+  }
+  piece->peers[slot] = peer;
+  piece->n_peers++;
+}
+
+// Request blocks of piece until peer's request queue is full. A block is asked
+// from a single peer, unless several peers share the piece in endgame mode.
 void request_piece_blocks(Peer *peer, Piece *piece) {
-  int MAX_OUTSTANDING_BLOCKS = 10;
-
-  if (piece->outstanding_requests_count >= MAX_OUTSTANDING_BLOCKS) return;
-  for (uint32_t block_idx = 0 ; block_idx < piece->total_blocks; block_idx++) {
-    if (piece->outstanding_requests_count >= MAX_OUTSTANDING_BLOCKS) break;
-    bool unasked = piece->asked_blocks[block_idx] == 0;
-    bool downloaded = piece->recieved_blocks[block_idx] == 1;
-    if (unasked && !downloaded) {
+  bool endgame = piece->n_peers > 1;
+  // Every block is either requested or recieved
+  if (!endgame && piece->outstanding_requests_count + piece->recieved_count == piece->total_blocks) return;
+
+  uint8_t slot_bit = 1 << piece_peer_slot(piece, peer);
+  for (uint32_t word = 0; word < piece->block_words; word++) {
+    // Blocks still missing. Outside endgame only those nobody was asked for
+    uint64_t wanted = ~piece->recieved_blocks[word];
+    if (!endgame) wanted &= ~piece->requested_blocks[word];
+    for (; wanted != 0; wanted &= wanted - 1) {
+      uint32_t block_idx = word * 64 + __builtin_ctzll(wanted);
+      if (block_idx >= piece->total_blocks || peer->outstanding_requests >= peer->max_requests) return;
+      uint8_t asked = piece->asked_blocks[block_idx];
+      if (asked & slot_bit) continue;
+
       if (DEBUG) printf("Asking for block %d\n", block_idx);
-      uint32_t payload[3];
-      // index, begin, length
-      payload[0] = htonl(piece->piece_idx);
-      payload[1] = htonl(block_idx * piece->block_size);
-      payload[2] = htonl(block_idx == piece->total_blocks - 1 ? piece->last_block_size: piece->block_size);
-      Message request = { .length = 3 * 4, .type = MSG_REQUEST, .payload = payload};
-      uint8_t secs = time(NULL) & 0xFF;
-      if (secs == 0) secs += 1;
-      if (DEBUG) printf("Sending REQUEST: Peer %d, Piece_%d[%d] Time: %d\n", peer->peer_idx, piece->piece_idx, block_idx, secs);
-      send_msg(peer, request);
+      send_request(peer, piece->piece_idx, block_idx * piece->block_size, block_length(piece, block_idx));
+      // The request didn't go out
+      if (peer->stage >= S_ERROR) return;
 
-      piece->outstanding_requests_count++;
-      piece->asked_blocks[block_idx] = secs;
+      if (asked == 0) {
+        piece->outstanding_requests_count++;
+        bitset_set(piece->requested_blocks, block_idx);
+      }
+      peer->outstanding_requests++;
+      piece->asked_blocks[block_idx] |= slot_bit;
     }
   }
 }
 
-void clear_outstanding_requests(Piece *piece) {
+// peer won't answer its request for block_idx
+void drop_block_request(Peer *peer, Piece *piece, uint32_t block_idx) {
+  int slot = piece_peer_slot(piece, peer);
+  if (slot == -1 || !(piece->asked_blocks[block_idx] & (1 << slot))) return;
+  piece->asked_blocks[block_idx] &= ~(1 << slot);
+  if (piece->asked_blocks[block_idx] == 0) {
+    piece->outstanding_requests_count--;
+    bitset_clear(piece->requested_blocks, block_idx);
+  }
+  peer->outstanding_requests--;
+}
+
+// A choking peer discards all requests it hasn't answered yet
+void clear_outstanding_requests(Peer *peer, Piece *piece) {
   if (piece->state != PS_DOWNLOADING) {
     fprintf(stderr, "[BUG] clear_oustanding_requests called for piece at state: %d\n", piece->state);
     return;
   }
 
-  uint8_t secs = time(NULL) & 0xFF;
-  if (secs == 0) secs += 1;
-  int count = 0;
-  for (int block_idx = 0; block_idx < piece->total_blocks; block_idx++) {
-    uint8_t asked = piece->asked_blocks[block_idx];
-    if (asked != 0 && asked < secs - 4) {
-      piece->asked_blocks[block_idx] = 0;
-      piece->outstanding_requests_count--;
-      count++;
+  // Only blocks with a request out can be dropped
+  for (uint32_t word = 0; word < piece->block_words; word++) {
+    uint64_t pending = piece->requested_blocks[word] & ~piece->recieved_blocks[word];
+    for (; pending != 0; pending &= pending - 1) {
+      drop_block_request(peer, piece, word * 64 + __builtin_ctzll(pending));
     }
   }
-  if (DEBUG) printf("Cleared %d reqs with time older than %d - 4\n", count, secs);
+  if (DEBUG) printf("Cleared reqs of piece %d\n", piece->piece_idx);
 }
 
-Piece *save_piece_block(Torrent *t, Message msg) {
-  // while (recieved_count != total_blocks)
-
-  if (msg.type != MSG_PIECE) {
-    fprintf(stderr, "[BUG] Got message of type %d. Ignoring.\n", msg.type);
-    exit(1);
-  }
-
+// Where the payload of a PIECE message from peer goes, given its header. NULL
+// when it is dropped: unwanted, malformed, or already arriving from another
+// peer in endgame mode.
+uint8_t *piece_block_destination(Torrent *t, Peer *peer, Message msg) {
   uint32_t index = read_uint32(msg.payload, 0);
   if (index >= t->n_pieces) {
     fprintf(stderr, "Invalid piece_idx (%d) in PIECE response. n_piece = %d\n", index, t->n_pieces);
@@ -206,27 +415,58 @@ Piece *save_piece_block(Torrent *t, Message msg) {
 
   if (piece->state != PS_DOWNLOADING) {
     printf("Recieved data for unwnated piece idx: %u. piece state: %d\n", index, piece->state);
-  } else if (index != piece->piece_idx) {
-    fprintf(stderr, "[BUG] index %u and piece_idx %u doesn't match\n", index, piece->piece_idx);
-    exit(1);
+  } else if (piece_peer_slot(piece, peer) == -1) {
+    printf("Recieved data for piece %u from peer %d, which isn't downloading it\n", index, peer->peer_idx);
   } else if (begin % piece->block_size != 0) {
     printf("Recieved data doesn't align with block size: Got %u\n", begin);
   } else if (block_idx >= piece->total_blocks) {
     printf("Recieved data's block index exceeds total blocks: Got %u, Expected: %u\n", block_idx, piece->total_blocks);
-  } else if (block_idx == piece->total_blocks - 1 && block_size != piece->last_block_size) {
-    printf("Final block size doesn't match: Got %u, Expected: %u\n", block_size, piece->last_block_size);
-  } else if (block_idx != piece->total_blocks -1 && block_size != piece->block_size) {
-    printf("Full block size doesn't match: Got %u, Expected: %u\n", block_size, piece->block_size);
-  } else if (piece->recieved_blocks[block_idx]) {
+  } else if (block_size != block_length(piece, block_idx)) {
+    printf("Block size doesn't match: Got %u, Expected: %u\n", block_size, block_length(piece, block_idx));
+  } else if (bitset_get(piece->recieved_blocks, block_idx)) {
     if (DEBUG) printf("Block %d already recieved. Ignoring\n", block_idx);
+    drop_block_request(peer, piece, block_idx);
   } else {
+    for (int slot = 0; slot < MAX_PIECE_PEERS; slot++) {
+      Peer *other = piece->peers[slot];
+      if (other != NULL && other != peer && other->block_piece == piece && other->block_idx == block_idx) {
+        if (DEBUG) printf("Block %d is already arriving from peer %d. Ignoring\n", block_idx, other->peer_idx);
+        drop_block_request(peer, piece, block_idx);
+        return NULL;
+      }
+    }
     // All good
-    if (DEBUG) printf("Recieved block: %d, size: %d\n", block_idx, block_size);
-    piece->recieved_count++;
-    piece->outstanding_requests_count--;
-    piece->recieved_blocks[block_idx] = 1;
-    memcpy(piece->buffer + begin, msg.payload + 8, block_size);
+    peer->block_piece = piece;
+    peer->block_idx = block_idx;
+    return piece->buffer + begin;
   }
+  return NULL;
+}
+
+// The payload of peer's current block is in place. Returns its piece
+Piece *store_piece_block(Peer *peer) {
+  Piece *piece = peer->block_piece;
+  uint32_t block_idx = peer->block_idx;
+  peer->block_piece = NULL;
+  if (DEBUG) printf("Recieved block: %d of piece %d\n", block_idx, piece->piece_idx);
+
+  piece->recieved_count++;
+  // Requests cleared on CHOKE may still be answered, so asked can be 0
+  uint8_t asked = piece->asked_blocks[block_idx];
+  if (asked != 0) piece->outstanding_requests_count--;
+  piece->asked_blocks[block_idx] = 0;
+  bitset_clear(piece->requested_blocks, block_idx);
+  for (int slot = 0; slot < MAX_PIECE_PEERS; slot++) {
+    if (!(asked & (1 << slot))) continue;
+    Peer *asked_peer = piece->peers[slot];
+    asked_peer->outstanding_requests--;
+    // Endgame duplicate that is still on its way
+    if (asked_peer != peer && asked_peer->stage == S_ACTIVE) {
+      send_cancel(asked_peer, piece->piece_idx, block_idx * piece->block_size, block_length(piece, block_idx));
+    }
+  }
+  bitset_set(piece->recieved_blocks, block_idx);
+  hash_piece_blocks(piece);
   return piece;
 }
 
@@ -265,20 +505,28 @@ Peer create_peer(int peer_idx, int n_pieces, size_t buffer_size) {
   p.bitmap_size = ceil_division(n_pieces, 8);
   p.bitmap = malloc(p.bitmap_size);
   memset(p.bitmap, 0, p.bitmap_size);
-  p.buffer_size = buffer_size;
-  p.recvbuffer = malloc(p.buffer_size);
+  // recvbuffer is a ring mapped in whole pages
+  int page_size = getpagesize();
+  p.buffer_size = ceil_division(buffer_size, page_size) * page_size;
+  p.recvbuffer = create_recvbuffer(p.buffer_size);
+  p.max_requests = MIN_REQUESTS;
+  p.speed_ma = -1;
+  // Room for a BITFIELD and a full queue of REQUEST and HAVE messages
+  p.sendbuffer_size = p.bitmap_size + 16 * 1024;
+  p.sendbuffer = malloc(p.sendbuffer_size);
   return p;
 }
 
 void free_peer(Peer *p) {
   free(p->bitmap);
-  free(p->recvbuffer);
+  free_recvbuffer(p->recvbuffer, p->buffer_size);
+  free(p->sendbuffer);
 }
 
 Piece *select_piece_for_download(Torrent *t, Peer *peer) {
 
   if (t->downloaded_pieces + t->active_pieces >= t->n_pieces) {
-    printf("[.select_piece] All pieces are active or downloaded\n");
+    if (DEBUG) printf("[.select_piece] All pieces are active or downloaded\n");
     return NULL;
   }
 
@@ -286,15 +534,11 @@ Piece *select_piece_for_download(Torrent *t, Peer *peer) {
     printf("Selecting piece for download\n");
     printf("peer bitmap: "); pprint_hex(peer->bitmap, peer->bitmap_size);printf("\n");
   }
-  // find an inactive piece
-  for (int i=0; i<t->n_pieces; i++) {
-    Piece p = t->pieces[i];
-    if (p.state == PS_INIT && aref_bit(peer->bitmap, peer->bitmap_size, p.piece_idx) == 1) {
-      return t->pieces + i;
-    }
-  }
+  // find the rarest inactive piece
+  Piece *piece = picker_select(&t->picker, t->pieces, peer);
+  if (piece != NULL) return piece;
 
-  printf("downloaded_pieces(%d) + active_pieces(%d) is less than "
+  if (DEBUG) printf("downloaded_pieces(%d) + active_pieces(%d) is less than "
          "n_pieces (%d). but couldn't select a piece\n",
          t->downloaded_pieces, t->active_pieces, t->n_pieces);
 
@@ -328,14 +572,23 @@ Torrent create_torrent(Value *torrent) {
                .downloaded_pieces = 0,
                .infohash = infohash,
                .piece_length = piece_length,
-               .file_length = file_length};
+               .file_length = file_length,
+               .piece_memory = DEFAULT_PIECE_MEMORY};
+  picker_init(&o.picker, n_pieces);
 
   return o;
 }
 
 void free_torrent(Torrent *t) {
+  for (int i = 0; i < t->n_pieces; i++) {
+    free(t->pieces[i].resume_blocks);
+  }
   free(t->infohash.str);
   free(t->pieces);
+  picker_free(&t->picker);
+  pool_free(&t->pool);
+  free(t->wanted);
+  free(t->downloading);
 }
 
 Piece *activate_peer_and_piece(Torrent *t, Peer *peer) {
@@ -343,19 +596,21 @@ Piece *activate_peer_and_piece(Torrent *t, Peer *peer) {
     fprintf(stderr, "[BUG?] Activating chocked peer\n");
     return NULL;
   }
-  if (peer->stage == S_ACTIVE) {
-    fprintf(stderr, "[BUG?] Activating already active peer\n");
+  if (peer->stage >= S_ERROR || peer->n_pieces == MAX_PEER_PIECES) return NULL;
+  // Out of piece memory. Peers are asked again once a slot is released
+  if (pool_exhausted(&t->pool)) {
+    t->pool.starved = true;
     return NULL;
   }
 
   Piece *piece = select_piece_for_download(t, peer);
   if (piece != NULL) {
     initalize_piece_for_download(t, peer, piece);
-    piece->state = PS_DOWNLOADING;
+    set_piece_state(t, piece, PS_DOWNLOADING);
     peer->stage = S_ACTIVE;
 
-    piece->current_peer = peer;
-    peer->piece = piece;
+    add_piece_peer(piece, peer);
+    peer->pieces[peer->n_pieces++] = piece;
 
     t->active_pieces++;
 
@@ -364,6 +619,68 @@ Piece *activate_peer_and_piece(Torrent *t, Peer *peer) {
   return NULL;
 }
 
+// Endgame mode: every remaining piece is being downloaded or verified, so
+// peer helps with the piece that has the fewest peers. Its blocks get
+// requested from several peers, and the duplicates are cancelled as blocks
+// arrive.
+Piece *join_endgame_piece(Torrent *t, Peer *peer) {
+  if (peer->stage >= S_ERROR || peer->n_pieces == MAX_PEER_PIECES) return NULL;
+  int verifying = disk_in_flight(t->disk) - t->resume_stat_pending;
+  if (t->downloaded_pieces + t->active_pieces + verifying < t->n_pieces) return NULL;
+
+  Piece *best = NULL;
+  for (int i = 0; i < t->n_downloading; i++) {
+    Piece *piece = t->downloading[i];
+    if (piece->n_peers == MAX_PIECE_PEERS) continue;
+    if (!aref_bit(peer->bitmap, peer->bitmap_size, piece->piece_idx) || piece_peer_slot(piece, peer) != -1) continue;
+    if (best == NULL || piece->n_peers < best->n_peers) best = piece;
+  }
+  if (best == NULL) return NULL;
+
+  printf("Endgame: peer %d joins piece %d with %d peers\n", peer->peer_idx, best->piece_idx, best->n_peers);
+  add_piece_peer(best, peer);
+  peer->pieces[peer->n_pieces++] = best;
+  peer->stage = S_ACTIVE;
+  return best;
+}
+
+// Fill peer's request queue. Another piece is taken on once every block of
+// the current ones has been requested, or shared with other peers in endgame.
+// Stops when a send fails, so a dead peer takes on nothing new.
+void request_blocks(Torrent *t, Peer *peer) {
+  int i = 0;
+  while (peer->stage < S_ERROR && peer->outstanding_requests < peer->max_requests) {
+    if (i == peer->n_pieces && activate_peer_and_piece(t, peer) == NULL && join_endgame_piece(t, peer) == NULL) break;
+    request_piece_blocks(peer, peer->pieces[i]);
+    i++;
+  }
+}
+
+// Size the request queue to twice the bandwidth-delay product, so the pipe
+// stays full while requests travel to the peer. rtt is the kernel's smoothed
+// estimate for the connection.
+void update_peer_pipeline(Peer *p) {
+  float elapsed_ms = NOW_MS - p->speed_timestamp_ms;
+  if (elapsed_ms < 500) return;
+
+  float speed = p->speed_bytes_recieved / elapsed_ms * 1000; // B/s
+  p->speed_ma = p->speed_ma == -1 ? speed / 1024 : p->speed_ma * 0.9 + 0.1 * speed / 1024; // KiB/s
+  p->speed_bytes_recieved = 0;
+  p->speed_timestamp_ms = NOW_MS;
+
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  if (getsockopt(p->sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+    p->rtt_ms = info.tcpi_rtt / 1000.0f;
+  }
+
+  int blocks = speed * p->rtt_ms / 1000 * 2 / (16 * 1024) + 1;
+  if (blocks < MIN_REQUESTS) blocks = MIN_REQUESTS;
+  if (blocks > MAX_REQUESTS) blocks = MAX_REQUESTS;
+  if (DEBUG && blocks != p->max_requests) printf("Peer %d request queue: %d blocks\n", p->peer_idx, blocks);
+  p->max_requests = blocks;
+}
+
 Peer *select_peer_and_piece(Peer *peers, int n_peers, Torrent *t) {
   if (t->downloaded_pieces + t->active_pieces >= t->n_pieces) return NULL;
 
@@ -372,8 +689,7 @@ Peer *select_peer_and_piece(Peer *peers, int n_peers, Torrent *t) {
   for (int i=0; i<n_peers; i++) {
     Peer *p = peers + i;
     if (p->unchoked && p->stage == S_HANDSHAKED) {
-      int count = count_interesting_pieces(t, p);
-      if (count > 0) {
+      if (p->n_interesting > 0) {
         if (!best_peer) {
           best_peer = p;
           best_priority = p->priority;
@@ -415,36 +731,172 @@ Peer *select_peer_for_download(Peer *peers, int n_peers, int piece_idx) {
   return best_peer;
 }
 
-// Does cleanup on piece only if its in DOWNLOADING or FLUSHED stage
-void deactivate_peer_and_piece(Torrent *t, Peer *peer) {
+// Stop downloading piece from peer. Once the last peer leaves, does cleanup on
+// piece only if its in DOWNLOADING stage. Peer goes back to HANDSHAKED after
+// its last piece.
+void release_peer_piece(Torrent *t, Peer *peer, Piece *piece) {
   if (!(peer->stage == S_ACTIVE || peer->stage == S_ERROR)) {
-    fprintf(stderr, "[BUG] deactivate_peer called on peer %d at stage: %d\n", peer->peer_idx, peer->stage);
+    fprintf(stderr, "[BUG] release_peer_piece called on peer %d at stage: %d\n", peer->peer_idx, peer->stage);
     exit(1);
   }
-  if (peer->piece == NULL) {
-    fprintf(stderr, "[BUG] peer %d is at stage %d but peer.piece is null\n", peer->peer_idx, peer->stage);
+  int i = 0;
+  while (i < peer->n_pieces && peer->pieces[i] != piece) i++;
+  if (i == peer->n_pieces) {
+    fprintf(stderr, "[BUG] peer %d isn't downloading piece %d\n", peer->peer_idx, piece->piece_idx);
     exit(1);
   }
 
+  // Cleanup state in peer. The rest of a block on its way into the piece is
+  // dropped, as the buffer may be freed
+  if (peer->block_piece == piece) {
+    peer->block_piece = NULL;
+    peer->block_dst = NULL;
+  }
+  if (piece->state == PS_DOWNLOADING) {
+    clear_outstanding_requests(peer, piece);
+  }
+  memmove(peer->pieces + i, peer->pieces + i + 1, sizeof(Piece *) * (peer->n_pieces - i - 1));
+  peer->n_pieces--;
+  if (peer->n_pieces == 0 && peer->stage != S_ERROR)
+    peer->stage = S_HANDSHAKED;
+
   // Cleanup state in piece
-  Piece *piece = peer->piece;
-  piece->current_peer = NULL;
+  piece->peers[piece_peer_slot(piece, peer)] = NULL;
+  piece->n_peers--;
+  if (piece->n_peers > 0) return;
   t->active_pieces--;
   if (piece->state == PS_DOWNLOADING) {
-    piece->state = PS_INIT;
-    cleanup_piece_after_download(piece);
+    set_piece_state(t, piece, PS_INIT);
+    cleanup_piece_after_download(t, piece);
   }
+}
 
-  // Cleanup state in peer
-  if (peer->stage != S_ERROR)
-    peer->stage = S_HANDSHAKED;
-  peer->piece = NULL;
+void deactivate_peer_and_pieces(Torrent *t, Peer *peer) {
+  while (peer->n_pieces > 0) {
+    release_peer_piece(t, peer, peer->pieces[peer->n_pieces - 1]);
+  }
+}
+
+// Record that peer has piece_idx, counting it in the piece's availability
+void peer_has_piece(Torrent *t, Peer *peer, uint32_t piece_idx) {
+  if (aref_bit(peer->bitmap, peer->bitmap_size, piece_idx)) return;
+  setf_bit(peer->bitmap, peer->bitmap_size, piece_idx, 1);
+  picker_inc(&t->picker, piece_idx);
+  peer->n_available++;
+  if (t->pieces[piece_idx].state == PS_INIT) peer->n_interesting++;
+}
+
+// Add the pieces of a BITFIELD message to what peer has. Returns true when
+// one of them is wanted. A BITFIELD of the wrong size drops the peer
+bool peer_has_pieces(Torrent *t, Peer *peer, uint8_t *bits, int n_bytes) {
+  if (n_bytes != peer->bitmap_size) {
+    fprintf(stderr, "Peer %d sent BITFIELD of %d bytes. Expected %d\n", peer->peer_idx, n_bytes, peer->bitmap_size);
+    peer->stage = S_ERROR;
+    return false;
+  }
+  // Spare bits past the last piece are ignored
+  if (t->n_pieces % 8 != 0) bits[n_bytes - 1] &= 0xff << (8 - t->n_pieces % 8);
+
+  uint8_t *added = malloc(n_bytes);
+  bitfield_or(peer->bitmap, bits, added, n_bytes);
+  for (int i = bitfield_next_set(added, n_bytes, 0); i != -1; i = bitfield_next_set(added, n_bytes, i + 1)) {
+    picker_inc(&t->picker, i);
+  }
+  int interesting = bitfield_and_count(added, t->wanted, n_bytes);
+  peer->n_available += bitfield_count(added, n_bytes);
+  peer->n_interesting += interesting;
+  free(added);
+  return interesting > 0;
 }
 
-void process_peer_read(Peer *peer, Torrent *t) {
+// Peer disconnected. Its pieces no longer count towards availability
+void forget_peer_pieces(Torrent *t, Peer *peer) {
+  for (int i = bitfield_next_set(peer->bitmap, peer->bitmap_size, 0); i != -1;
+       i = bitfield_next_set(peer->bitmap, peer->bitmap_size, i + 1)) {
+    picker_dec(&t->picker, i);
+  }
+  memset(peer->bitmap, 0, peer->bitmap_size);
+  peer->n_available = 0;
+  peer->n_interesting = 0;
+}
+
+// Release everything a peer held once it is dropped from the event loop
+void peer_failed(Torrent *t, Peer *peer) {
+  deactivate_peer_and_pieces(t, peer);
+  forget_peer_pieces(t, peer);
+}
+
+// Returns the number of bytes read from socket. 0 when the socket has been
+// drained or the peer errored.
+int process_peer_read(Peer *peer, Torrent *t) {
   if (DEBUG) printf("[msg from %d]\n", peer->peer_idx);
   fflush(stdout);
-  peer_recv(peer);
+  int bytes = peer_recv(peer);
+  if (bytes == 0) {
+    if (peer->stage == S_ERROR) {
+      deactivate_peer_and_pieces(t, peer);
+    }
+    return 0;
+  }
+
+  process_peer_messages(peer, t);
+  return bytes;
+}
+
+// Store peer's current block once all of it has arrived, and hand the piece to
+// the disk stage when that was its last block
+void finish_piece_block(Torrent *t, Peer *peer) {
+  if (peer->block_piece == NULL || peer->block_remaining > 0) return;
+
+  Piece *piece = store_piece_block(peer);
+  t->downloading_blocks++;
+  if (piece->recieved_count == piece->total_blocks) {
+    printf("Download complete for piece %d\n", piece->piece_idx);
+    set_piece_state(t, piece, PS_VERIFYING);
+    for (int slot = 0; slot < MAX_PIECE_PEERS; slot++) {
+      if (piece->peers[slot] != NULL) release_peer_piece(t, piece->peers[slot], piece);
+    }
+    submit_piece_to_disk(t, piece);
+  }
+}
+
+// Largest block a peer may request
+#define MAX_UPLOAD_LENGTH (16 * 1024)
+
+// Queue a REQUEST from peer for a block of a piece that is on disk
+void queue_upload_request(Torrent *t, Peer *peer, Message msg) {
+  if (msg.length != 12) {
+    printf("Ignoring REQUEST of length %u\n", msg.length);
+    return;
+  }
+  UploadRequest request = {read_uint32(msg.payload, 0), read_uint32(msg.payload, 4), read_uint32(msg.payload, 8)};
+  if (DEBUG) printf("Peer %d requests %d[%d] size %d\n", peer->peer_idx, request.index, request.begin, request.length);
+
+  if (t->storage == NULL || request.index >= t->n_pieces || t->pieces[request.index].state != PS_FLUSHED) {
+    printf("Peer %d requested piece %u, which we can't upload\n", peer->peer_idx, request.index);
+  } else if (request.length == 0 || request.length > MAX_UPLOAD_LENGTH ||
+             (uint64_t)request.begin + request.length > piece_size(t, request.index)) {
+    printf("Peer %d requested invalid range %u + %u of piece %u\n", peer->peer_idx, request.begin, request.length, request.index);
+  } else if (!queue_upload(peer, request)) {
+    printf("Upload queue of peer %d is full. Dropping request\n", peer->peer_idx);
+  }
+}
+
+// Hand bytes read by io_uring to peer, processing messages as they complete
+void process_peer_bytes(Peer *peer, Torrent *t, uint8_t *data, int len) {
+  while (len > 0 && peer->stage < S_ERROR) {
+    int bytes = peer_recv_bytes(peer, data, len);
+    if (bytes == 0) break;
+    process_peer_messages(peer, t);
+    data += bytes;
+    len -= bytes;
+  }
+}
+
+// Handle a block that arrived, and all complete messages in peer's
+// recvbuffer, then schedule requests
+void process_peer_messages(Peer *peer, Torrent *t) {
+  finish_piece_block(t, peer);
 
   // Complete handshake the first time the peer sends data
   if (peer->stage == S_WAIT_HANDSHAKE) {
@@ -458,11 +910,12 @@ void process_peer_read(Peer *peer, Torrent *t) {
   while (msg.type >= 0) {
     if (peer->stage != S_HANDSHAKED && peer->stage != S_ACTIVE) {
       printf("Ignoring message at stage: %d\n", peer->stage);
+      if (msg.type == MSG_PIECE && msg.length >= 8) peer_recv_block(peer, NULL, msg.length - 8);
     } else if (msg.type == MSG_CHOKE) {
       if (DEBUG_MSGTYPE) printf(" Got CHOKE\n");
       peer->unchoked = false;
-      if (peer->stage == S_ACTIVE) {
-        clear_outstanding_requests(peer->piece);
+      for (int i = 0; i < peer->n_pieces; i++) {
+        clear_outstanding_requests(peer, peer->pieces[i]);
       }
     } else if (msg.type == MSG_UNCHOKE) {
       if (DEBUG_MSGTYPE) printf(" Got UNCHOKE\n");
@@ -484,7 +937,7 @@ void process_peer_read(Peer *peer, Torrent *t) {
       if (piece_idx >= t->n_pieces) {
         fprintf(stderr, "Invalid piece_idx (%d) in HAVE response. n_piece = %d\n", piece_idx, t->n_pieces);
       } else {
-        setf_bit(peer->bitmap, peer->bitmap_size, piece_idx, 1);
+        peer_has_piece(t, peer, piece_idx);
         if (DEBUG) {
           printf("New bitmap: ");
           pprint_hex(peer->bitmap, peer->bitmap_size);
@@ -496,63 +949,33 @@ void process_peer_read(Peer *peer, Torrent *t) {
         }
       }
 
-      /* if (peer->piece != NULL) { */
-      /*   clear_outstanding_requests(peer->piece); */
-      /*   request_piece_blocks(peer, peer->piece); */
-      /* } */
-
-
     } else if (msg.type == MSG_BITFIELD) {
       if (DEBUG_MSGTYPE) printf(" Got BITFIELD\n");
 
-      bool has_interesting_piece = false;
-      for (int i=0; i < t->n_pieces; i++) {
-        Piece *piece = t->pieces + i;
-        if (aref_bit(msg.payload, msg.length, piece->piece_idx)) {
-          setf_bit(peer->bitmap, peer->bitmap_size, piece->piece_idx, 1);
-          if (piece->state < PS_DOWNLOADED) has_interesting_piece = true;
-        }
-      }
-
-      if (has_interesting_piece) send_interested(peer);
+      if (peer_has_pieces(t, peer, msg.payload, msg.length)) send_interested(peer);
     } else if (msg.type == MSG_REQUEST) {
       if (DEBUG_MSGTYPE) printf(" Got REQUEST\n");
 
-      // TODO: Ignore request messages
+      queue_upload_request(t, peer, msg);
     } else if (msg.type == MSG_CANCEL) {
       if (DEBUG_MSGTYPE) printf(" Got CANCLE\n");
 
-      // TODO: Ignore cancle messages
+      if (msg.length == 12) {
+        UploadRequest request = {read_uint32(msg.payload, 0), read_uint32(msg.payload, 4), read_uint32(msg.payload, 8)};
+        cancel_upload(peer, request);
+      }
     } else if (msg.type == MSG_PIECE) {
-      // store
-      if (peer->stage != S_ACTIVE) {
-        printf("Ignoring piece from a peer who is not active\n");
+      if (msg.length < 8) {
+        printf("Ignoring PIECE message of length %u\n", msg.length);
       } else {
-        Piece *piece = save_piece_block(t, msg);
-        if (piece == NULL) {
-          // do nothing
-        } else if (piece->recieved_count != piece->total_blocks) {
-          // request_piece_blocks(peer, piece);
+        uint8_t *dst = NULL;
+        if (peer->stage != S_ACTIVE) {
+          printf("Ignoring piece from a peer who is not active\n");
         } else {
-          printf("Download complete for piece %d\n", piece->piece_idx);
-          if (verify_piece(piece)) {
-            piece->state = PS_DOWNLOADED;
-            t->downloaded_pieces++;
-
-            if (t->output_file != NULL) {
-              // Save to disk
-              fseek(t->output_file, piece->piece_idx * t->piece_length, SEEK_SET);
-              int success = fwrite(piece->buffer, piece->piece_length, 1, t->output_file);
-              if (success == 1) {
-                printf("Piece %d saved to disk\n", piece->piece_idx);
-                cleanup_piece_after_download(piece);
-                piece->state = PS_FLUSHED;
-              }
-            }
-            // and send a HAVE to all active peers
-          }
-          deactivate_peer_and_piece(t, peer);
+          dst = piece_block_destination(t, peer, msg);
         }
+        peer_recv_block(peer, dst, msg.length - 8);
+        finish_piece_block(t, peer);
       }
     } else {
       fprintf(stderr, "Unknown message type %d\n", msg.type);
@@ -561,24 +984,23 @@ void process_peer_read(Peer *peer, Torrent *t) {
     msg = pop_message(peer);
   }
 
-  if (peer->stage == S_ERROR && peer->piece != NULL) {
-    deactivate_peer_and_piece(t, peer);
+  if (peer->stage < S_ERROR && !peer->write_blocked) {
+    flush_peer_output(peer, t);
+  }
+
+  if (peer->stage == S_ERROR) {
+    deactivate_peer_and_pieces(t, peer);
   }
 
   bool download_complete = t->downloaded_pieces >= t->n_pieces;
   if (download_complete) {
     // Do nothing
-  } else if (peer->stage == S_ACTIVE && peer->unchoked) {
-    request_piece_blocks(peer, peer->piece);
-  } else if (peer->stage != S_HANDSHAKED) {
+  } else if (peer->stage != S_HANDSHAKED && peer->stage != S_ACTIVE) {
     // ignore
   } else if (!peer->unchoked) {
     //send_interested(peer);
   } else {
-    Piece *piece = activate_peer_and_piece(t, peer);
-    if (piece != NULL) {
-      request_piece_blocks(peer, piece);
-    }
+    request_blocks(t, peer);
   }
 }
 
@@ -591,23 +1013,23 @@ void send_keepalives_and_disconnects(Peer *peers, int n_peers, Torrent *t) {
     for (int i = 0; i < n_peers; i++) {
       Peer *p = peers + i;
       // Check for peers that don't answer outstanding piece requests, or are slow
-      Peer *best_alternative_peer = p->piece == NULL ? NULL : select_peer_for_download(peers, n_peers, p->piece->piece_idx);
+      Peer *best_alternative_peer = p->n_pieces == 0 ? NULL : select_peer_for_download(peers, n_peers, p->pieces[0]->piece_idx);
       if (best_alternative_peer != NULL && best_alternative_peer != p) {
         bool deactivated = false;
 
         if (NOW - p->last_msg_time > 10) {
-          printf("Deactivating peer (%d) and piece (%d). Because no block "
+          printf("Deactivating peer (%d) and its %d pieces. Because no block "
                  "recieved in last 10 seconds\n",
-                 p->peer_idx, p->piece->piece_idx);
-          deactivate_peer_and_piece(t, p);
+                 p->peer_idx, p->n_pieces);
+          deactivate_peer_and_pieces(t, p);
           p->priority-=10;
           deactivated = true;
-        } else if (p->piece->speed_ma != -1 && p->piece->speed_ma < t->total_ma_speed_download * 0.1) {
+        } else if (p->speed_ma != -1 && p->speed_ma < t->total_ma_speed_download * 0.1) {
           // Check for peers that are too slow
-          printf("Deactivating peer (%d) and piece (%d). Because it is very "
+          printf("Deactivating peer (%d) and its %d pieces. Because it is very "
                  "slow\n",
-                 p->peer_idx, p->piece->piece_idx);
-          deactivate_peer_and_piece(t, p);
+                 p->peer_idx, p->n_pieces);
+          deactivate_peer_and_pieces(t, p);
           p->priority--;
           deactivated = true;
         }
@@ -615,10 +1037,7 @@ void send_keepalives_and_disconnects(Peer *peers, int n_peers, Torrent *t) {
         if (deactivated) {
           // Find another peer
           Peer *best_peer = select_peer_and_piece(peers, n_peers, t);
-          if (best_peer != NULL) {
-            Piece *piece = activate_peer_and_piece(t, best_peer);
-            if (piece != NULL) request_piece_blocks(best_peer, piece);
-          }
+          if (best_peer != NULL) request_blocks(t, best_peer);
         }
       }
 
@@ -635,86 +1054,222 @@ void send_keepalives_and_disconnects(Peer *peers, int n_peers, Torrent *t) {
 }
 
 
-int start_communication_loop(Peer *peers, int n_peers, Torrent *t) {
+// Called when a connecting peer's socket becomes writable
+void process_peer_writable(Peer *p, Torrent *t) {
+  if (p->stage == S_CONNECTING) {
+    process_peer_connect(p);
+  }
+  if (p->stage == S_CONNECTED) {
+    send_handshake(&t->infohash, p->sock);
+    p->stage = S_WAIT_HANDSHAKE;
+  }
+}
+
+void update_clock(time_t baseline_secs) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  NOW = now.tv_sec - baseline_secs;
+  NOW_MS = (now.tv_sec - baseline_secs) * 1000 + now.tv_usec / 1000.0;
+}
+
+// Work done once per event loop iteration. Returns true when the download is
+// complete and all connections have been closed.
+bool finish_loop_iteration(Peer *peers, int n_peers, Torrent *t) {
+  bool closed = false;
+  if (t->downloaded_pieces == t->n_pieces || STOP_REQUESTED || t->disk_failed) {
+    if (STOP_REQUESTED) {
+      printf("Stopping. Closing connections\n");
+    } else if (t->disk_failed) {
+      printf("Pieces can't be written to disk. Closing connections\n");
+    } else {
+      printf("All pieces downloaded. Closing connections\n");
+    }
+    for (int i=0; i < n_peers; i++) {
+      Peer *peer = peers + i;
+      if (peer->stage <= S_CONNECTING) {
+        peer->stage = S_DONE;
+      } else if (peer->stage == S_ERROR) {
+        // Do nothing
+      } else {
+        printf("Closed connection with %d. \n", peer->peer_idx);
+        close(peer->sock);
+        peer->stage = S_DONE;
+      }
+    }
+    closed = true;
+  } else {
+    float total_speed = 0;
+    for (int i = 0; i < n_peers; i++) {
+      Peer *peer = peers + i;
+      if (peer->stage == S_HANDSHAKED || peer->stage == S_ACTIVE) {
+        update_peer_pipeline(peer);
+        if (peer->speed_ma != -1) total_speed += peer->speed_ma;
+      }
+    }
+    t->total_ma_speed_download = total_speed;
+    send_keepalives_and_disconnects(peers, n_peers, t);
+    if (t->pool.starved && !pool_exhausted(&t->pool)) {
+      t->pool.starved = false;
+      for (int i = 0; i < n_peers; i++) {
+        Peer *peer = peers + i;
+        if ((peer->stage == S_HANDSHAKED || peer->stage == S_ACTIVE) && peer->unchoked) request_blocks(t, peer);
+      }
+    }
+
+    if (NOW - t->resume_saved_at >= RESUME_INTERVAL && request_resume_save(t)) {
+      t->resume_saved_at = NOW;
+    }
+  }
+  print_summary(peers, n_peers, t);
+  return closed;
+}
+
+int start_epoll_loop(Peer *peers, int n_peers, Torrent *t) {
   time_t baseline_secs = time(NULL);
 
-  int nfds = 0;
-  for (int idx = 0; idx < n_peers; idx++) {
-    if (peers[idx].sock + 1 > nfds)
-      nfds = peers[idx].sock + 1;
+  int epfd = epoll_create1(0);
+  if (epfd == -1) {
+    fprintf(stderr, "epoll_create1 failed with error: %d %s\n", errno, strerror(errno));
+    return 1;
   }
 
-  // Main loop
-  fd_set readfds, writefds;
-  struct timeval timeout = {};
-  int done = false;
-  printf("Starting communication loop with nfds: %d, n_peers: %d\n", nfds, n_peers);
-  while (!done) {
-    // Initialize fd sets
-    FD_ZERO(&readfds);
-    FD_ZERO(&writefds);
-    int n_active = 0;
-    for (int i=0; i<n_peers; i++) {
-      if (peers[i].stage != S_DONE && peers[i].stage != S_ERROR) {
-        n_active++;
-        int fd = peers[i].sock;
-        FD_SET(fd, &readfds);
-        if (peers[i].stage == S_CONNECTING)
-          FD_SET(fd, &writefds);
-      }
+  // Register every peer once, with the peer itself as user data. Edge
+  // triggered: each readiness change is reported once, so reads are drained
+  // until EAGAIN.
+  int n_registered = 0;
+  for (int i = 0; i < n_peers; i++) {
+    Peer *p = peers + i;
+    if (p->stage == S_DONE || p->stage == S_ERROR) continue;
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = p};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, p->sock, &ev) == -1) {
+      fprintf(stderr, "Couldn't watch peer %d. epoll_ctl error: %d %s\n", p->peer_idx, errno, strerror(errno));
+      p->stage = S_ERROR;
+      continue;
     }
-    if (n_active == 0) break;
+    p->registered = true;
+    n_registered++;
+  }
+
+  // Completions from disk stage. NULL user data marks it apart from peers
+  struct epoll_event disk_ev = {.events = EPOLLIN | EPOLLET, .data.ptr = NULL};
+  epoll_ctl(epfd, EPOLL_CTL_ADD, disk_event_fd(t->disk), &disk_ev);
+
+  // Main loop
+  int MAX_EVENTS = 64;
+  struct epoll_event events[MAX_EVENTS];
+  printf("Starting communication loop with n_peers: %d\n", n_peers);
+  // Keep running after connections are closed, until queued pieces are flushed
+  while (n_registered > 0 || disk_in_flight(t->disk) > 0) {
     // Wait for event
     if (DEBUG) printf("[[Waiting for events]] ");
 
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
-    int ready_count = select(nfds, &readfds, &writefds, NULL, &timeout);
-    if (ready_count == -1) {
-      fprintf(stderr, "select failed with error: %d %s\n", errno, strerror(errno));
+    int ready_count = epoll_wait(epfd, events, MAX_EVENTS, 5000);
+    if (ready_count == -1 && errno == EINTR) {
+      // A signal. Still finish the iteration, it may be a stop request
+      ready_count = 0;
+    } else if (ready_count == -1) {
+      fprintf(stderr, "epoll_wait failed with error: %d %s\n", errno, strerror(errno));
+      close(epfd);
       return 1;
     } else {
       if (DEBUG) printf(" got %d\n", ready_count);
     }
 
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    NOW = now.tv_sec - baseline_secs;
-    NOW_MS = (now.tv_sec - baseline_secs) * 1000 + now.tv_usec / 1000.0;
+    update_clock(baseline_secs);
 
-    // Process event
-    for (int i=0; i<n_peers; i++) {
-      Peer *p = peers + i;
-      if (FD_ISSET(p->sock, &writefds)) {
-        if (process_peer_connect(p)) {
-          send_handshake(&t->infohash, p->sock);
-          p->stage = S_WAIT_HANDSHAKE;
+    // Process event, only for the peers that are ready
+    for (int i=0; i<ready_count; i++) {
+      Peer *p = events[i].data.ptr;
+      uint32_t ev = events[i].events;
+      if (p == NULL) continue; // disk stage, handled below
+
+      if (p->stage == S_CONNECTED || (p->stage == S_CONNECTING && (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)))) {
+        process_peer_writable(p, t);
+      }
+      if (p->stage > S_CONNECTED && p->stage < S_ERROR && (ev & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        while (process_peer_read(p, t) > 0) {
+          // Edge triggered. Read until the socket is drained
         }
       }
-      if (FD_ISSET(p->sock, &readfds)) {
-        process_peer_read(p, t);
-        shift_recvbuffer(p);
+      if (p->stage > S_CONNECTED && p->stage < S_ERROR && (ev & EPOLLOUT) && p->write_blocked) {
+        flush_peer_output(p, t);
       }
     }
 
-    if (t->downloaded_pieces == t->n_pieces) {
-      printf("All pieces downloaded. Closing connections\n");
-      for (int i=0; i < n_peers; i++) {
-        Peer *peer = peers + i;
-        if (peer->stage <= S_CONNECTING) {
-          peer->stage = S_DONE;
-        } else if (peer->stage == S_ERROR) {
-          // Do nothing
-        } else {
-          printf("Closed connection with %d. \n", peer->peer_idx);
-          close(peer->sock);
-          peer->stage = S_DONE;
-        }
+    process_disk_completions(t);
+    if (n_registered > 0) finish_loop_iteration(peers, n_peers, t);
+
+    // Peers fail on their own events, and on sends made while serving other
+    // peers or flushing pieces. All of them are released here, once
+    for (int i = 0; i < n_peers; i++) {
+      Peer *p = peers + i;
+      if (p->registered && p->stage >= S_ERROR) {
+        // fd may already be closed, in which case the kernel has dropped it
+        epoll_ctl(epfd, EPOLL_CTL_DEL, p->sock, NULL);
+        peer_failed(t, p);
+        p->registered = false;
+        n_registered--;
       }
-    } else {
-      send_keepalives_and_disconnects(peers, n_peers, t);
     }
-    print_summary(peers, n_peers, t);
   }
+  close(epfd);
   return 0;
 }
+
+int start_communication_loop(Peer *peers, int n_peers, Torrent *t) {
+  int ret = -1;
+  int bitmap_size = ceil_division(t->n_pieces, 8);
+  t->wanted = realloc(t->wanted, bitmap_size);
+  memset(t->wanted, 0, bitmap_size);
+  int n_wanted = 0;
+  memset(t->piece_states, 0, sizeof(t->piece_states));
+  t->downloading_blocks = 0;
+  for (int i = 0; i < t->n_pieces; i++) {
+    t->piece_states[t->pieces[i].state]++;
+    if (t->pieces[i].state == PS_INIT) {
+      setf_bit(t->wanted, bitmap_size, i, 1);
+      n_wanted++;
+    } else {
+      picker_remove(&t->picker, i);
+    }
+  }
+  for (int i = 0; i < n_peers; i++) {
+    peers[i].n_available = bitfield_count(peers[i].bitmap, peers[i].bitmap_size);
+    peers[i].n_interesting = bitfield_and_count(peers[i].bitmap, t->wanted, peers[i].bitmap_size);
+  }
+
+  // Each active piece takes a slot. Pieces recieved into a mapped file count
+  // against the budget as well, since their pages stay resident until flushed.
+  // Without storage, as in download_piece, pieces are kept in their slots
+  // until the loop ends, so every wanted piece gets one
+  uint64_t maps_size = piece_maps_size(t->piece_length);
+  bool mapped = t->storage != NULL && t->storage->map != NULL;
+  int max_slots = t->storage == NULL ? n_wanted : t->piece_memory / (t->piece_length + maps_size);
+  pool_init(&t->pool, mapped ? maps_size : piece_maps_offset(t->piece_length) + maps_size, max_slots);
+  t->downloading = realloc(t->downloading, sizeof(Piece *) * t->pool.max_slots);
+  t->n_downloading = 0;
+  t->disk = disk_start();
+  t->peers = peers;
+  t->n_peers = n_peers;
+
+  if (t->use_io_uring) {
+    Uring *ring = uring_create(256);
+    if (ring != NULL) {
+      t->ring = ring;
+      ret = start_uring_loop(peers, n_peers, t);
+      uring_free(ring);
+      t->ring = NULL;
+    } else {
+      fprintf(stderr, "io_uring not available. Falling back to epoll\n");
+    }
+  }
+  if (ret == -1) {
+    ret = start_epoll_loop(peers, n_peers, t);
+  }
+
+  disk_stop(t->disk);
+  t->disk = NULL;
+  t->peers = NULL;
+  t->n_peers = 0;
+  return ret;
+}
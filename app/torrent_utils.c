@@ -16,43 +16,26 @@ uint64_t torrent_total_length(Value *info) {
   }
 }
 
+// SHA1 of the info dict exactly as it appears in the torrent file. Trees
+// decoded without the source at hand get it re-encoded instead
 String info_hash(Value* torrent) {
   String hash_string = { 0 };
-  Value *info = gethash(torrent, "info");
+  KeyVal *entry = gethash_entry(torrent, "info");
+  Value *info = entry == NULL ? NULL : entry->val;
   if (!assert_type(info, TDict, "Torrent info is not a Dict")) return hash_string;
-  String *pieces = gethash_safe(info, "pieces", TString)->val.string;
-
-  char *buffer = malloc(pieces->length + 1024);
-  Cursor cur = {.str = buffer};
-  encode_bencode(info, &cur);
 
   char *hash = malloc(20);
-
-  SHA1(hash, buffer, cur.str - buffer);
-  free(buffer);
+  if (entry->raw.str != NULL) {
+    SHA1(hash, entry->raw.str, entry->raw.length);
+  } else {
+    char *buffer = malloc(encoded_size(info));
+    Cursor cur = {.str = buffer};
+    encode_bencode(info, &cur);
+    SHA1(hash, buffer, cur.str - buffer);
+    free(buffer);
+  }
 
   hash_string.length = 20;
   hash_string.str = hash;
   return hash_string;
 }
-
-int count_interesting_pieces(Torrent *t, Peer *p) {
-  int count = 0;
-  for (int piece_idx = 0; piece_idx < t->n_pieces; piece_idx++) {
-    Piece *piece = t->pieces + piece_idx;
-    if (piece->state == PS_INIT && aref_bit(p->bitmap, p->bitmap_size, piece_idx) == 1) {
-      count++;
-    }
-  }
-  return count;
-}
-
-int count_available_pieces(Peer *p, int n_pieces) {
-  int count = 0;
-  for (int piece_idx = 0; piece_idx < n_pieces; piece_idx++) {
-    if (aref_bit(p->bitmap, p->bitmap_size, piece_idx) == 1) {
-      count++;
-    }
-  }
-  return count;
-}
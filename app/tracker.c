@@ -16,19 +16,12 @@
 /// HTTP Tracker
 /////////
 
-static size_t cb_curl_write_to_string(void *data, size_t size, size_t blocks, void *callback_data) {
+// Response chunks are parsed as they arrive. A malformed response aborts the
+// transfer
+static size_t cb_curl_write_to_parser(void *data, size_t size, size_t blocks, void *callback_data) {
   size_t realsize = size * blocks;
-  String *str = (String *)callback_data;
-
-  char *ptr = realloc(str->str, str->length + realsize + 1);
-  if(!ptr)
-    return 0;  /* out of memory! */
-
-  str->str = ptr;
-  memcpy(&(str->str[str->length]), data, realsize);
-  str->length += realsize;
-  str->str[str->length] = 0;
-
+  BencodeParser *parser = (BencodeParser *)callback_data;
+  if (bencode_parser_feed(parser, data, realsize) == BENCODE_ERROR) return 0;
   return realsize;
 }
 
@@ -63,26 +56,37 @@ int http_fetch_peers(Value* torrent, struct sockaddr_in **peers) {
 
   curl_easy_setopt(curl, CURLOPT_URL, url);
 
-  String response = {.str = NULL, .length = 0};
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, cb_curl_write_to_string);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&response);
+  Arena arena;
+  arena_init(&arena, 16 * 1024);
+  BencodeParser parser;
+  bencode_parser_init(&parser, &arena);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, cb_curl_write_to_parser);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&parser);
 
   CURLcode code = curl_easy_perform(curl);
+  if (parser.error != NULL) {
+    fprintf(stderr, "Invalid response from tracker: %s\n", parser.error);
+    exit(1);
+  }
   if (code != CURLE_OK) {
-    fprintf(stderr, "Failed to fetch peers from tracker: %s\n", announce->str);
+    fprintf(stderr, "Failed to fetch peers from tracker: %.*s\n", announce->length, announce->str);
+    exit(1);
+  }
+  if (parser.root == NULL || parser.root->type != TDict) {
+    fprintf(stderr, "Incomplete response from tracker\n");
     exit(1);
   }
 
   curl_easy_cleanup(curl);
-
-  Cursor cur2 = {.str = response.str };
-  Value *res = decode_bencode(&cur2);
+  bencode_parser_free(&parser);
 
   free(hash.str);
   free(url);
 
-  String *peers_buff = gethash_safe(res, "peers", TString)->val.string;
-  return parse_peer_addresses(peers_buff, peers);
+  String *peers_buff = gethash_safe(parser.root, "peers", TString)->val.string;
+  int n_peers = parse_peer_addresses(peers_buff, peers);
+  arena_free(&arena);
+  return n_peers;
 }
 
 //////////
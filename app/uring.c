@@ -0,0 +1,398 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include "app.h"
+#include "packets.h"
+
+#define DEBUG false
+
+// io_uring engine. Every peer socket keeps one multishot recv posted, which
+// picks buffers from a shared provided-buffer ring, and verified pieces are
+// written to the output file through the same ring. One io_uring_enter per
+// loop iteration submits everything and reaps all completions.
+
+// Operation tag stored in the low bits of user_data. Peer and Piece pointers
+// are at least 8 byte aligned.
+enum UringOp {
+  U_RECV = 0,
+  U_CONNECT = 1,
+  U_WRITE = 2,
+  U_CANCEL = 3,
+  U_DISK = 4,
+  U_SEND = 5,
+};
+
+#define U_TAG_MASK 0x7
+#define RECV_BUF_SIZE (32 * 1024)
+#define RECV_BUF_COUNT 64 // power of 2
+#define RECV_BUF_GROUP 0
+
+struct Uring {
+  int fd;
+
+  // Submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sqe_tail;
+  struct io_uring_sqe *sqes;
+
+  // Completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *ring_ptr;
+  size_t ring_size;
+  size_t sqes_size;
+
+  // Provided buffers for multishot recv
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  uint16_t buf_tail;
+  uint8_t *bufs;
+
+  int pending_writes;
+};
+
+int uring_enter(Uring *ring, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+  return syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+void uring_recycle_buffer(Uring *ring, uint16_t bid) {
+  struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (RECV_BUF_COUNT - 1)];
+  buf->addr = (uint64_t)(ring->bufs + bid * RECV_BUF_SIZE);
+  buf->len = RECV_BUF_SIZE;
+  buf->bid = bid;
+  ring->buf_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+Uring *uring_create(unsigned entries) {
+  struct io_uring_params params = {0};
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = entries * 4;
+  int fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) {
+    fprintf(stderr, "io_uring_setup failed: %d %s\n", errno, strerror(errno));
+    return NULL;
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+    fprintf(stderr, "io_uring of this kernel is too old\n");
+    close(fd);
+    return NULL;
+  }
+
+  Uring *ring = malloc(sizeof(Uring));
+  memset(ring, 0, sizeof(Uring));
+  ring->fd = fd;
+
+  // SQ and CQ rings share one mapping
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->ring_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    fprintf(stderr, "Couldn't mmap io_uring: %d %s\n", errno, strerror(errno));
+    close(fd);
+    free(ring);
+    return NULL;
+  }
+
+  uint8_t *ptr = ring->ring_ptr;
+  ring->sq_head = (unsigned *)(ptr + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(ptr + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(ptr + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->sqe_tail = *ring->sq_tail;
+  // sqes[i] always sits at array[i]
+  unsigned *sq_array = (unsigned *)(ptr + params.sq_off.array);
+  for (unsigned i = 0; i < params.sq_entries; i++) sq_array[i] = i;
+
+  ring->cq_head = (unsigned *)(ptr + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(ptr + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(ptr + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(ptr + params.cq_off.cqes);
+
+  // Provided buffer ring for multishot recv
+  ring->buf_ring_size = RECV_BUF_COUNT * sizeof(struct io_uring_buf);
+  ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ring->bufs = malloc(RECV_BUF_COUNT * RECV_BUF_SIZE);
+  struct io_uring_buf_reg reg = {
+    .ring_addr = (uint64_t)ring->buf_ring,
+    .ring_entries = RECV_BUF_COUNT,
+    .bgid = RECV_BUF_GROUP,
+  };
+  if (ring->buf_ring == MAP_FAILED ||
+      syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    fprintf(stderr, "Couldn't register io_uring buffer ring: %d %s\n", errno, strerror(errno));
+    if (ring->buf_ring == MAP_FAILED) ring->buf_ring = NULL;
+    uring_free(ring);
+    return NULL;
+  }
+  for (uint16_t bid = 0; bid < RECV_BUF_COUNT; bid++) {
+    uring_recycle_buffer(ring, bid);
+  }
+
+  return ring;
+}
+
+void uring_free(Uring *ring) {
+  close(ring->fd);
+  munmap(ring->ring_ptr, ring->ring_size);
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->buf_ring != NULL) munmap(ring->buf_ring, ring->buf_ring_size);
+  free(ring->bufs);
+  free(ring);
+}
+
+unsigned uring_unsubmitted(Uring *ring) {
+  return ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+  if (uring_unsubmitted(ring) >= ring->sq_entries) {
+    // Queue is full. Submit what we have to make space
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    if (uring_enter(ring, uring_unsubmitted(ring), 0, 0, NULL, 0) < 0) {
+      fprintf(stderr, "[BUG] io_uring_enter failed while submitting: %d %s\n", errno, strerror(errno));
+      exit(1);
+    }
+  }
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sqe_tail++;
+  return sqe;
+}
+
+void uring_recv(Uring *ring, Peer *p) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = p->sock;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RECV_BUF_GROUP;
+  sqe->user_data = (uint64_t)p | U_RECV;
+}
+
+void uring_poll_connect(Uring *ring, Peer *p) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = p->sock;
+  sqe->poll32_events = POLLOUT;
+  sqe->user_data = (uint64_t)p | U_CONNECT;
+}
+
+void uring_cancel_recv(Uring *ring, Peer *p) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t)p | U_RECV;
+  sqe->user_data = U_CANCEL;
+}
+
+// Writes stop at the end of a file. The rest of the piece goes out as another
+// write from the completion, until all of it is flushed
+void uring_write_piece(Uring *ring, Torrent *t, Piece *piece) {
+  uint64_t offset = piece->piece_idx * t->piece_length + piece->flushed_bytes;
+  StorageSpan span;
+  if (!storage_acquire_span(t->storage, offset, piece->piece_length - piece->flushed_bytes, &span)) {
+    fprintf(stderr, "Couldn't open file to write piece %d: %d %s\n", piece->piece_idx, errno, strerror(errno));
+    piece_write_failed(t, piece);
+    return;
+  }
+
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = span.fd;
+  sqe->off = span.file_offset;
+  sqe->addr = (uint64_t)(piece->buffer + piece->flushed_bytes);
+  sqe->len = span.length;
+  sqe->user_data = (uint64_t)piece | U_WRITE;
+  ring->pending_writes++;
+}
+
+// Wake up when the socket takes data again, to flush queued output
+void uring_poll_send(Uring *ring, Peer *p) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = p->sock;
+  sqe->poll32_events = POLLOUT;
+  sqe->user_data = (uint64_t)p | U_SEND;
+  p->send_poll_pending = true;
+}
+
+// Wake up when the disk stage has completions
+void uring_poll_disk(Uring *ring, Torrent *t) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = disk_event_fd(t->disk);
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = U_DISK;
+}
+
+// Submit queued SQEs and wait upto timeout_ms for at least one completion
+bool uring_submit_and_wait(Uring *ring, int timeout_ms) {
+  struct __kernel_timespec ts = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000};
+  struct io_uring_getevents_arg arg = {.ts = (uint64_t)&ts};
+
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  int ret = uring_enter(ring, uring_unsubmitted(ring), 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+  if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+    fprintf(stderr, "io_uring_enter failed with error: %d %s\n", errno, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+// Peer moved to S_ERROR or S_DONE. Called once, from the sweep
+void uring_peer_failed(Uring *ring, Torrent *t, Peer *p) {
+  peer_failed(t, p);
+  uring_cancel_recv(ring, p);
+}
+
+// A peer that fails here is released by the sweep in start_uring_loop
+void uring_process_recv(Uring *ring, Torrent *t, Peer *p, struct io_uring_cqe *cqe) {
+  bool has_buffer = cqe->flags & IORING_CQE_F_BUFFER;
+  uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+  if (p->stage >= S_ERROR) {
+    // Completion that was in flight when the peer was dropped
+    if (has_buffer) uring_recycle_buffer(ring, bid);
+    return;
+  }
+
+  if (cqe->res > 0) {
+    process_peer_bytes(p, t, ring->bufs + bid * RECV_BUF_SIZE, cqe->res);
+    uring_recycle_buffer(ring, bid);
+  } else if (cqe->res == 0) {
+    fprintf(stderr, "Peer disconnected without sending\n");
+    p->stage = S_ERROR;
+  } else if (cqe->res == -ENOBUFS) {
+    // Ran out of provided buffers. Rearmed below
+    if (DEBUG) printf("Peer %d: recv ran out of buffers\n", p->peer_idx);
+  } else {
+    fprintf(stderr, "Error occured while recv: %d %s\n", -cqe->res, strerror(-cqe->res));
+    p->stage = S_ERROR;
+  }
+
+  if (p->stage < S_ERROR && !(cqe->flags & IORING_CQE_F_MORE)) {
+    uring_recv(ring, p);
+  }
+}
+
+void uring_process_write(Uring *ring, Torrent *t, Piece *piece, struct io_uring_cqe *cqe) {
+  ring->pending_writes--;
+  // The file the write went to stays open until now
+  storage_release(t->storage, storage_locate(t->storage, piece->piece_idx * t->piece_length + piece->flushed_bytes));
+  if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+    uring_write_piece(ring, t, piece);
+    return;
+  }
+  if (cqe->res <= 0) {
+    fprintf(stderr, "Couldn't write piece %d to disk: %d %s\n", piece->piece_idx, -cqe->res, strerror(-cqe->res));
+    piece_write_failed(t, piece);
+    return;
+  }
+
+  piece->flushed_bytes += cqe->res;
+  if (piece->flushed_bytes < piece->piece_length) {
+    // Short write, queue the rest
+    uring_write_piece(ring, t, piece);
+  } else {
+    piece_flushed(t, piece);
+  }
+}
+
+int start_uring_loop(Peer *peers, int n_peers, Torrent *t) {
+  time_t baseline_secs = time(NULL);
+  Uring *ring = t->ring;
+
+  int n_registered = 0;
+  for (int i = 0; i < n_peers; i++) {
+    Peer *p = peers + i;
+    if (p->stage == S_DONE || p->stage == S_ERROR) continue;
+    if (p->stage == S_CONNECTING) {
+      uring_poll_connect(ring, p);
+    } else {
+      process_peer_writable(p, t);
+      uring_recv(ring, p);
+    }
+    p->registered = true;
+    n_registered++;
+  }
+
+  uring_poll_disk(ring, t);
+
+  printf("Starting io_uring communication loop with n_peers: %d\n", n_peers);
+  // Keep running after connections are closed, until queued pieces are flushed
+  while (n_registered > 0 || ring->pending_writes > 0 || disk_in_flight(t->disk) > 0) {
+    if (DEBUG) printf("[[Waiting for completions]]\n");
+    if (!uring_submit_and_wait(ring, 5000)) return 1;
+
+    update_clock(baseline_secs);
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+      void *ptr = (void *)(cqe->user_data & ~(uint64_t)U_TAG_MASK);
+      enum UringOp op = cqe->user_data & U_TAG_MASK;
+
+      if (op == U_RECV) {
+        uring_process_recv(ring, t, ptr, cqe);
+      } else if (op == U_CONNECT) {
+        Peer *p = ptr;
+        if (p->stage != S_CONNECTING) continue;
+        process_peer_writable(p, t);
+        if (p->stage == S_WAIT_HANDSHAKE) uring_recv(ring, p);
+      } else if (op == U_WRITE) {
+        uring_process_write(ring, t, ptr, cqe);
+      } else if (op == U_DISK) {
+        uring_poll_disk(ring, t);
+      } else if (op == U_SEND) {
+        Peer *p = ptr;
+        p->send_poll_pending = false;
+        // Polls outlive a peer that failed elsewhere
+        if (p->stage < S_ERROR) flush_peer_output(p, t);
+      }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    // Peers with output the socket refused get a poll. It is rearmed by the
+    // flush if the socket is still full. One poll per peer at a time
+    for (int i = 0; i < n_peers; i++) {
+      Peer *p = peers + i;
+      if (p->write_blocked && !p->send_poll_pending && p->stage > S_CONNECTED && p->stage < S_ERROR) {
+        p->write_blocked = false;
+        uring_poll_send(ring, p);
+      }
+    }
+
+    process_disk_completions(t);
+    if (n_registered > 0) finish_loop_iteration(peers, n_peers, t);
+
+    // Peers fail on their own completions, and on sends made while serving
+    // other peers or flushing pieces. All of them are released here, once
+    for (int i = 0; i < n_peers; i++) {
+      Peer *p = peers + i;
+      if (p->registered && p->stage >= S_ERROR) {
+        uring_peer_failed(ring, t, p);
+        p->registered = false;
+        n_registered--;
+      }
+    }
+  }
+  return 0;
+}
@@ -135,3 +135,17 @@ void setf_bit(uint8_t *bitmap, int n_bytes, int index, bool value) {
   }
   *(bitmap + byte_index) = new_byte;
 }
+
+// Bitsets of 64-bit words, with bit i in word i / 64. Unlike the BITFIELD
+// bitmaps above they are scanned a word at a time
+bool bitset_get(uint64_t *bits, uint32_t index) {
+  return (bits[index / 64] >> (index % 64)) & 1;
+}
+
+void bitset_set(uint64_t *bits, uint32_t index) {
+  bits[index / 64] |= 1ULL << (index % 64);
+}
+
+void bitset_clear(uint64_t *bits, uint32_t index) {
+  bits[index / 64] &= ~(1ULL << (index % 64));
+}